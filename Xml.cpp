@@ -1,19 +1,427 @@
 #include "Xml.h"
 
+#include <bit>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#ifdef XML_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef XML_ZSTD
+#include <zstd.h>
+#endif
+
 static inline bool isControlCode(unsigned char value){ return (value <= 8 || (value >= 14 && value <= 31) || value == 127); }
 
+enum class Utf8Status : unsigned char
+{
+    Valid,
+    ControlCharacter,
+    InvalidSequence,
+    Incomplete
+};
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+
+//Lookup tables of Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+//The high and low nibble of a byte and the high nibble of the next one each select the errors that pair of bytes may be,
+//an error is set in all three only for an invalid pair. Third and fourth bytes are checked from the lead 2 and 3 bytes back.
+enum : unsigned char
+{
+    Utf8TooShort = 1 << 0,
+    Utf8TooLong = 1 << 1,
+    Utf8Overlong3 = 1 << 2,
+    Utf8TooLarge = 1 << 3,
+    Utf8Surrogate = 1 << 4,
+    Utf8Overlong2 = 1 << 5,
+    Utf8TooLarge1000 = 1 << 6,
+    Utf8Overlong4 = 1 << 6,
+    Utf8TwoConts = 1 << 7,
+    Utf8Carry = Utf8TooShort | Utf8TooLong | Utf8TwoConts
+};
+
+alignas(16) static constexpr unsigned char utf8Byte1High[16] =
+{
+    Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong,
+    Utf8TwoConts, Utf8TwoConts, Utf8TwoConts, Utf8TwoConts,
+    Utf8TooShort | Utf8Overlong2,
+    Utf8TooShort,
+    Utf8TooShort | Utf8Overlong3 | Utf8Surrogate,
+    Utf8TooShort | Utf8TooLarge | Utf8TooLarge1000 | Utf8Overlong4
+};
+
+alignas(16) static constexpr unsigned char utf8Byte1Low[16] =
+{
+    Utf8Carry | Utf8Overlong3 | Utf8Overlong2 | Utf8Overlong4,
+    Utf8Carry | Utf8Overlong2,
+    Utf8Carry,
+    Utf8Carry,
+    Utf8Carry | Utf8TooLarge,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000 | Utf8Surrogate,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000
+};
+
+alignas(16) static constexpr unsigned char utf8Byte2High[16] =
+{
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Overlong3 | Utf8TooLarge1000 | Utf8Overlong4,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Overlong3 | Utf8TooLarge,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Surrogate | Utf8TooLarge,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Surrogate | Utf8TooLarge,
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort
+};
+
+//Subtracted with saturation from the last bytes of a block, non zero where a sequence is still open
+alignas(32) static constexpr unsigned char utf8Open[32] =
+{
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+#ifdef __AVX2__
+
+//Returns the length of the valid prefix made of whole blocks, it ends on a character boundary
+static std::size_t validateUtf8Blocks(const unsigned char * bytes, std::size_t size)
+{
+    const __m256i high1 = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(utf8Byte1High))),
+                  low1 = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(utf8Byte1Low))),
+                  high2 = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(utf8Byte2High))),
+                  open = _mm256_load_si256(reinterpret_cast<const __m256i *>(utf8Open));
+    const __m256i zero = _mm256_setzero_si256(), nibble = _mm256_set1_epi8(0x0F), top = _mm256_set1_epi8(static_cast<char>(0x80)),
+                  third = _mm256_set1_epi8(0xE0 - 0x80), fourth = _mm256_set1_epi8(0xF0 - 0x80),
+                  minus = _mm256_set1_epi8(-1), nine = _mm256_set1_epi8(9), thirteen = _mm256_set1_epi8(13), space = _mm256_set1_epi8(32), del = _mm256_set1_epi8(127);
+
+    __m256i previous = zero, incomplete = zero;
+    std::size_t i = 0;
+
+    for(; size - i >= 32; i += 32)
+    {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes + i));
+
+        __m256i error = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi8(nine, block), _mm256_cmpgt_epi8(block, minus)), _mm256_cmpeq_epi8(block, del)),
+                                        _mm256_and_si256(_mm256_cmpgt_epi8(block, thirteen), _mm256_cmpgt_epi8(space, block)));
+
+        const bool ascii = (_mm256_movemask_epi8(block) == 0);
+
+        if(ascii) error = _mm256_or_si256(error, incomplete);
+        else
+        {
+           const __m256i carried = _mm256_permute2x128_si256(previous, block, 0x21);
+           const __m256i prev1 = _mm256_alignr_epi8(block, carried, 15);
+
+           const __m256i special = _mm256_and_si256(_mm256_and_si256(_mm256_shuffle_epi8(high1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                                                                     _mm256_shuffle_epi8(low1, _mm256_and_si256(prev1, nibble))),
+                                                    _mm256_shuffle_epi8(high2, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble)));
+
+           const __m256i must = _mm256_and_si256(_mm256_or_si256(_mm256_subs_epu8(_mm256_alignr_epi8(block, carried, 14), third),
+                                                                 _mm256_subs_epu8(_mm256_alignr_epi8(block, carried, 13), fourth)), top);
+
+           error = _mm256_or_si256(error, _mm256_xor_si256(must, special));
+        }
+
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(error, zero)) != -1) break;
+
+        incomplete = (ascii) ? zero : _mm256_subs_epu8(block, open);
+        previous = block;
+    }
+
+    //A sequence left open by the last valid block is checked again from its lead byte
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(incomplete, zero)) != -1)
+    {
+       while((bytes[i - 1] & 0xC0) == 0x80) i--;
+       i--;
+    }
+
+    return i;
+}
+
+#else
+
+//Returns the length of the valid prefix made of whole blocks, it ends on a character boundary
+static std::size_t validateUtf8Blocks(const unsigned char * bytes, std::size_t size)
+{
+    const __m128i high1 = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8Byte1High)),
+                  low1 = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8Byte1Low)),
+                  high2 = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8Byte2High)),
+                  open = _mm_load_si128(reinterpret_cast<const __m128i *>(utf8Open + 16));
+    const __m128i zero = _mm_setzero_si128(), nibble = _mm_set1_epi8(0x0F), top = _mm_set1_epi8(static_cast<char>(0x80)),
+                  third = _mm_set1_epi8(0xE0 - 0x80), fourth = _mm_set1_epi8(0xF0 - 0x80),
+                  minus = _mm_set1_epi8(-1), nine = _mm_set1_epi8(9), thirteen = _mm_set1_epi8(13), space = _mm_set1_epi8(32), del = _mm_set1_epi8(127);
+
+    __m128i previous = zero, incomplete = zero;
+    std::size_t i = 0;
+
+    for(; size - i >= 16; i += 16)
+    {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+
+        __m128i error = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_cmplt_epi8(block, nine), _mm_cmpgt_epi8(block, minus)), _mm_cmpeq_epi8(block, del)),
+                                     _mm_and_si128(_mm_cmpgt_epi8(block, thirteen), _mm_cmplt_epi8(block, space)));
+
+        const bool ascii = (_mm_movemask_epi8(block) == 0);
+
+        if(ascii) error = _mm_or_si128(error, incomplete);
+        else
+        {
+           const __m128i prev1 = _mm_alignr_epi8(block, previous, 15);
+
+           const __m128i special = _mm_and_si128(_mm_and_si128(_mm_shuffle_epi8(high1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                                                               _mm_shuffle_epi8(low1, _mm_and_si128(prev1, nibble))),
+                                                 _mm_shuffle_epi8(high2, _mm_and_si128(_mm_srli_epi16(block, 4), nibble)));
+
+           const __m128i must = _mm_and_si128(_mm_or_si128(_mm_subs_epu8(_mm_alignr_epi8(block, previous, 14), third),
+                                                           _mm_subs_epu8(_mm_alignr_epi8(block, previous, 13), fourth)), top);
+
+           error = _mm_or_si128(error, _mm_xor_si128(must, special));
+        }
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xFFFF) break;
+
+        incomplete = (ascii) ? zero : _mm_subs_epu8(block, open);
+        previous = block;
+    }
+
+    //A sequence left open by the last valid block is checked again from its lead byte
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(incomplete, zero)) != 0xFFFF)
+    {
+       while((bytes[i - 1] & 0xC0) == 0x80) i--;
+       i--;
+    }
+
+    return i;
+}
+
+#endif
+#endif
+
+//Validates UTF-8 and rejects control characters in one pass. With SSSE3 or AVX2 whole blocks are checked by lookup tables first,
+//otherwise ASCII runs are checked 16 bytes at a time. offset receives the first rejected byte or the start of the rejected sequence.
+static Utf8Status validateUtf8(const char * data, std::size_t size, std::size_t & offset)
+{
+    const unsigned char * const bytes = reinterpret_cast<const unsigned char *>(data);
+#if defined(__AVX2__) || defined(__SSSE3__)
+    std::size_t i = validateUtf8Blocks(bytes, size);
+#else
+    std::size_t i = 0;
+#endif
+
+    while(i < size)
+    {
+#ifdef __SSE2__
+          const __m128i nine = _mm_set1_epi8(9), thirteen = _mm_set1_epi8(13), space = _mm_set1_epi8(32), del = _mm_set1_epi8(127);
+
+          for(; size - i >= 16; i += 16)
+          {
+              const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+
+              //Bytes >= 0x80 are negative as signed and fall into the first range
+              const __m128i reject = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(block, nine), _mm_cmpeq_epi8(block, del)),
+                                                  _mm_and_si128(_mm_cmpgt_epi8(block, thirteen), _mm_cmplt_epi8(block, space)));
+
+              const int mask = _mm_movemask_epi8(reject);
+
+              if(mask != 0)
+              {
+                 i += std::countr_zero(static_cast<unsigned int>(mask));
+                 break;
+              }
+          }
+
+          if(i == size) break;
+#endif
+
+          const unsigned char ch = bytes[i];
+
+          if(ch < 0x80)
+          {
+             if(isControlCode(ch))
+             {
+                offset = i;
+                return Utf8Status::ControlCharacter;
+             }
+
+             i++;
+             continue;
+          }
+
+          std::size_t length;
+          unsigned char min = 0x80, max = 0xBF;
+
+          if(ch >= 0xC2 && ch <= 0xDF) length = 2;
+          else if(ch >= 0xE0 && ch <= 0xEF)
+          {
+             length = 3;
+             if(ch == 0xE0) min = 0xA0;
+             else if(ch == 0xED) max = 0x9F;
+          }
+          else if(ch >= 0xF0 && ch <= 0xF4)
+          {
+             length = 4;
+             if(ch == 0xF0) min = 0x90;
+             else if(ch == 0xF4) max = 0x8F;
+          }
+          else
+          {
+             offset = i;
+             return Utf8Status::InvalidSequence;
+          }
+
+          for(std::size_t k = 1; k < length; k++)
+          {
+              if(i + k == size)
+              {
+                 offset = i;
+                 return Utf8Status::Incomplete;
+              }
+
+              const unsigned char next = bytes[i + k];
+
+              if(next < min || next > max)
+              {
+                 offset = i;
+                 return Utf8Status::InvalidSequence;
+              }
+
+              min = 0x80;
+              max = 0xBF;
+          }
+
+          i += length;
+    }
+
+    offset = size;
+    return Utf8Status::Valid;
+}
+
 //-------------------------------------------------------------------------------------------
 
-XmlStringViewBufferReader::XmlStringViewBufferReader(std::string_view xml):XmlBufferReader(), _xml(xml){}
+struct XmlTraceHook
+{
+    XmlTrace::Hook hook;
+    void * user;
+};
+
+//A hook and its user pointer are published together, installed pairs are never freed as another thread may still be calling one
+static std::atomic<const XmlTraceHook *> traceHook = nullptr;
+
+void XmlTrace::setHook(Hook hook, void * user)
+{
+    static std::mutex mutex;
+    static std::list<XmlTraceHook> hooks;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = std::find_if(hooks.begin(), hooks.end(), [&](const XmlTraceHook & entry){ return entry.hook == hook && entry.user == user; });
+    if(iter == hooks.end()) iter = hooks.insert(hooks.end(), XmlTraceHook{hook, user});
+    traceHook.store(&*iter, std::memory_order_release);
+}
+
+XmlTrace::Hook XmlTrace::hook()
+{
+    const XmlTraceHook * entry = traceHook.load(std::memory_order_acquire);
+    return (entry != nullptr) ? entry->hook : nullptr;
+}
+
+void * XmlTrace::user()
+{
+    const XmlTraceHook * entry = traceHook.load(std::memory_order_acquire);
+    return (entry != nullptr) ? entry->user : nullptr;
+}
+
+#ifdef XML_STATISTICS
+
+class XmlTraceScope final
+{
+    XmlTrace::Phase phase;
+    std::chrono::nanoseconds & time;
+    const XmlTraceHook * hook;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit XmlTraceScope(XmlTrace::Phase phase, std::chrono::nanoseconds & time):phase(phase), time(time), hook(traceHook.load(std::memory_order_acquire))
+    {
+        if(hook != nullptr && hook->hook != nullptr) hook->hook(phase, true, hook->user);
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~XmlTraceScope()
+    {
+        time += std::chrono::steady_clock::now() - start;
+        if(hook != nullptr && hook->hook != nullptr) hook->hook(phase, false, hook->user);
+    }
+};
+
+#define XML_STATISTIC(expr) expr
+#define XML_TRACE_SCOPE(phase, time) XmlTraceScope traceScope(phase, time)
+
+#else
+
+#define XML_STATISTIC(expr)
+#define XML_TRACE_SCOPE(phase, time)
+
+#endif
+
+//-------------------------------------------------------------------------------------------
+
+std::size_t XmlBufferReader::validate(const char * data, std::size_t size, std::size_t offset, bool last)
+{
+    std::size_t ready;
+    const Utf8Status status = validateUtf8(data, size, ready);
+
+    if(status == Utf8Status::Valid || (status == Utf8Status::Incomplete && !last))
+    {
+       if(_validation == NotValidated) _validation = Valid;
+       return ready;
+    }
+
+    _validation = (status == Utf8Status::ControlCharacter) ? ControlCharacter : InvalidSequence;
+    _validationOffset = offset + ready;
+    return ready;
+}
+
+//---------------
+
+XmlStringViewBufferReader::XmlStringViewBufferReader(std::string_view xml):XmlBufferReader(), _xml(xml)
+{
+    size = validate(_xml.data(), _xml.size(), 0, true);
+}
 
 bool XmlStringViewBufferReader::next()
 {
+    if(static_cast<std::size_t>(pos + 1) >= size)
+    {
+       pos = static_cast<long long>(size);
+       return false;
+    }
+
     pos++;
-    if(static_cast<std::size_t>(pos) == _xml.size()) return false;
     return true;
 }
 
-unsigned char XmlStringViewBufferReader::value(){ return (static_cast<std::size_t>(pos) == _xml.size()) ? 0 : _xml[pos]; }
+unsigned char XmlStringViewBufferReader::value(){ return (static_cast<std::size_t>(pos) == size) ? 0 : _xml[pos]; }
 
 std::size_t XmlStringViewBufferReader::offset(){ return static_cast<std::size_t>(pos); }
 
@@ -21,10 +429,41 @@ std::size_t XmlStringViewBufferReader::offset(){ return static_cast<std::size_t>
 
 XmlFileBufferReader::XmlFileBufferReader(){}
 
+bool XmlFileBufferReader::fill()
+{
+    XML_TRACE_SCOPE(XmlTrace::Read, _statistics.ioTime);
+
+    if(_validation > Valid) return false;
+
+    if(!block)
+    {
+       block = std::make_unique<char[]>(BlockSize);
+       XML_STATISTIC(_statistics.bufferAllocations++);
+    }
+
+    //The tail of an incomplete UTF-8 sequence is moved to the front and completed by this read
+    std::memmove(block.get(), block.get() + size, carry);
+    stream.read(block.get() + carry, static_cast<std::streamsize>(BlockSize - carry));
+
+    const std::size_t count = static_cast<std::size_t>(stream.gcount());
+    const std::size_t total = carry + count;
+    XML_STATISTIC(_statistics.bytes += count);
+
+    size = validate(block.get(), total, pos, count == 0 || stream.eof());
+    carry = total - size;
+    index = 0;
+    return size > 0;
+}
+
 bool XmlFileBufferReader::open(const std::string & fileName)
 {
     c = 0;
     pos = 0;
+    index = 0;
+    size = 0;
+    carry = 0;
+    _validation = NotValidated;
+    _validationOffset = 0;
     if(stream.is_open()) stream.close();
     stream.open(fileName);
     is_open = stream.is_open();
@@ -35,387 +474,2246 @@ bool XmlFileBufferReader::isOpen(){ return is_open; }
 
 bool XmlFileBufferReader::next()
 {
-    if(stream.get(c))
+    if(index == size && (!is_open || !fill())) return false;
+
+    c = block[index++];
+    pos++;
+    return true;
+}
+
+unsigned char XmlFileBufferReader::value(){ return c; }
+
+std::size_t XmlFileBufferReader::offset(){ return pos; }
+
+//---------------
+
+static const char * const CannotOpenFileMsg = "Cannot open file: ";
+
+struct XmlDecompressBufferReader::Pipeline
+{
+    static constexpr std::size_t BlockSize = 256 * 1024, Blocks = 3, Headroom = 4;
+
+    //The headroom in front of every block takes the carried tail of an incomplete UTF-8 sequence
+    std::unique_ptr<char[]> blocks[Blocks];
+    std::size_t sizes[Blocks] = {};
+    std::deque<std::size_t> ready, free;
+    std::size_t held = Blocks;
+    bool finished = true, stopping = false;
+    std::mutex mutex;
+    std::condition_variable produced, consumed;
+    std::thread thread;
+};
+
+XmlDecompressBufferReader::XmlDecompressBufferReader(bool pipelined):pipeline(std::make_unique<Pipeline>()), pipelined(pipelined){}
+
+XmlDecompressBufferReader::~XmlDecompressBufferReader(){ stop(); }
+
+void XmlDecompressBufferReader::start(bool opened)
+{
+    stop();
+
+    Pipeline & p = *pipeline;
+
+    for(auto & block : p.blocks)
+    {
+        if(block) continue;
+        block = std::make_unique<char[]>(Pipeline::BlockSize + Pipeline::Headroom);
+        XML_STATISTIC(_statistics.bufferAllocations++);
+    }
+
+    c = 0;
+    data = nullptr;
+    pos = index = size = carry = 0;
+    _validation = NotValidated;
+    _validationOffset = 0;
+    _error.clear();
+
+    p.ready.clear();
+    p.free = {0, 1, 2};
+    p.held = Pipeline::Blocks;
+    p.finished = !opened;
+    p.stopping = false;
+
+    if(!pipelined || !opened) return;
+
+    p.thread = std::thread([this, &p]
+    {
+        while(true)
+        {
+              std::size_t block;
+
+              {
+                  std::unique_lock<std::mutex> lock(p.mutex);
+                  p.consumed.wait(lock, [&]{ return p.stopping || !p.free.empty(); });
+                  if(p.stopping) return;
+                  block = p.free.front();
+                  p.free.pop_front();
+              }
+
+              const std::size_t count = decompress(p.blocks[block].get() + Pipeline::Headroom, Pipeline::BlockSize);
+
+              {
+                  std::lock_guard<std::mutex> lock(p.mutex);
+                  p.sizes[block] = count;
+                  if(count == 0) p.finished = true;
+                  else p.ready.push_back(block);
+              }
+
+              p.produced.notify_one();
+              if(count == 0) return;
+        }
+    });
+}
+
+void XmlDecompressBufferReader::stop()
+{
+    Pipeline & p = *pipeline;
+    if(!p.thread.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.stopping = true;
+    }
+
+    p.consumed.notify_one();
+    p.thread.join();
+}
+
+bool XmlDecompressBufferReader::take()
+{
+    XML_TRACE_SCOPE(XmlTrace::Read, _statistics.ioTime);
+
+    Pipeline & p = *pipeline;
+
+    while(_validation <= Valid)
     {
-       pos++;
-       return true;
+          std::size_t block = 0, count = 0;
+
+          if(pipelined)
+          {
+             std::unique_lock<std::mutex> lock(p.mutex);
+
+             if(p.held != Pipeline::Blocks)
+             {
+                p.free.push_back(p.held);
+                p.held = Pipeline::Blocks;
+                p.consumed.notify_one();
+             }
+
+             p.produced.wait(lock, [&]{ return !p.ready.empty() || p.finished; });
+
+             if(!p.ready.empty())
+             {
+                block = p.held = p.ready.front();
+                p.ready.pop_front();
+                count = p.sizes[block];
+             }
+          }
+          else if(!p.finished && p.blocks[0])
+          {
+             count = decompress(p.blocks[0].get() + Pipeline::Headroom, Pipeline::BlockSize);
+             p.finished = (count == 0);
+          }
+
+          if(count == 0)
+          {
+             //A sequence still incomplete at the end of the input is rejected here
+             if(carry > 0) validate(tail, carry, pos, true);
+             carry = 0;
+
+             //A failed input ends early, the parser has to see a rejection and not the end of the document
+             if(!_error.empty() && _validation <= Valid)
+             {
+                _validation = ReadError;
+                _validationOffset = pos;
+             }
+
+             return false;
+          }
+
+          char * const start = p.blocks[block].get() + Pipeline::Headroom - carry;
+          std::memcpy(start, tail, carry);
+
+          const std::size_t total = carry + count;
+          XML_STATISTIC(_statistics.bytes += count);
+
+          size = validate(start, total, pos, false);
+          carry = (_validation > Valid) ? 0 : total - size;
+          std::memcpy(tail, start + size, carry);
+          data = start;
+          index = 0;
+
+          if(size > 0) return true;
     }
 
     return false;
 }
 
-unsigned char XmlFileBufferReader::value(){ return c; }
+std::string XmlDecompressBufferReader::error() const { return _error; }
+
+bool XmlDecompressBufferReader::next()
+{
+    if(index == size && !take()) return false;
+
+    c = data[index++];
+    pos++;
+    return true;
+}
+
+unsigned char XmlDecompressBufferReader::value(){ return c; }
+
+std::size_t XmlDecompressBufferReader::offset(){ return pos; }
+
+//---------------
+
+static constexpr std::size_t CompressedInputSize = 256 * 1024;
+
+#ifdef XML_ZLIB
+
+struct XmlGzipBufferReader::Stream
+{
+    std::ifstream file;
+    z_stream z{};
+    bool initialized = false, end = false, member = false;
+    std::unique_ptr<unsigned char[]> input = std::make_unique<unsigned char[]>(CompressedInputSize);
+
+    ~Stream(){ if(initialized) inflateEnd(&z); }
+};
+
+XmlGzipBufferReader::XmlGzipBufferReader(bool pipelined):XmlDecompressBufferReader(pipelined){}
+
+XmlGzipBufferReader::~XmlGzipBufferReader(){ stop(); }
+
+bool XmlGzipBufferReader::open(const std::string & fileName)
+{
+    stop();
+    stream = std::make_unique<Stream>();
+    stream->file.open(fileName, std::ios::binary);
+
+    //15 + 32 accepts both gzip and zlib headers
+    is_open = stream->file.is_open() && inflateInit2(&stream->z, 15 + 32) == Z_OK;
+    stream->initialized = is_open;
+    start(is_open);
+    if(!is_open) _error = CannotOpenFileMsg + fileName;
+    return is_open;
+}
+
+bool XmlGzipBufferReader::isOpen(){ return is_open; }
+
+std::size_t XmlGzipBufferReader::decompress(char * data, std::size_t size)
+{
+    if(!is_open) return 0;
+
+    Stream & s = *stream;
+    s.z.next_out = reinterpret_cast<Bytef *>(data);
+    s.z.avail_out = static_cast<uInt>(size);
+
+    while(s.z.avail_out > 0 && !s.end)
+    {
+          if(s.z.avail_in == 0)
+          {
+             s.file.read(reinterpret_cast<char *>(s.input.get()), CompressedInputSize);
+             const std::size_t count = static_cast<std::size_t>(s.file.gcount());
+
+             if(count == 0)
+             {
+                if(s.member) _error = "Unexpected end of gzip stream";
+                s.end = true;
+                break;
+             }
+
+             s.z.next_in = s.input.get();
+             s.z.avail_in = static_cast<uInt>(count);
+          }
+
+          s.member = true;
+          const int ret = inflate(&s.z, Z_NO_FLUSH);
+
+          if(ret == Z_STREAM_END)
+          {
+             //Concatenated gzip members are read as one stream
+             s.member = false;
+             if(inflateReset(&s.z) != Z_OK) s.end = true;
+          }
+          else if(ret != Z_OK && ret != Z_BUF_ERROR)
+          {
+             _error = (s.z.msg != nullptr) ? s.z.msg : "Invalid gzip stream";
+             s.end = true;
+          }
+    }
+
+    return size - s.z.avail_out;
+}
+
+#endif
+
+#ifdef XML_ZSTD
+
+struct XmlZstdBufferReader::Stream
+{
+    std::ifstream file;
+    ZSTD_DCtx * context = ZSTD_createDCtx();
+    ZSTD_inBuffer in{nullptr, 0, 0};
+    std::size_t hint = 0;
+    bool end = false;
+    std::unique_ptr<char[]> input = std::make_unique<char[]>(CompressedInputSize);
+
+    ~Stream(){ ZSTD_freeDCtx(context); }
+};
+
+XmlZstdBufferReader::XmlZstdBufferReader(bool pipelined):XmlDecompressBufferReader(pipelined){}
+
+XmlZstdBufferReader::~XmlZstdBufferReader(){ stop(); }
+
+bool XmlZstdBufferReader::open(const std::string & fileName)
+{
+    stop();
+    stream = std::make_unique<Stream>();
+    stream->file.open(fileName, std::ios::binary);
+    is_open = stream->file.is_open() && stream->context != nullptr;
+    start(is_open);
+    if(!is_open) _error = CannotOpenFileMsg + fileName;
+    return is_open;
+}
+
+bool XmlZstdBufferReader::isOpen(){ return is_open; }
+
+std::size_t XmlZstdBufferReader::decompress(char * data, std::size_t size)
+{
+    if(!is_open) return 0;
+
+    Stream & s = *stream;
+    ZSTD_outBuffer out{data, size, 0};
+
+    while(out.pos < out.size && !s.end)
+    {
+          if(s.in.pos == s.in.size)
+          {
+             s.file.read(s.input.get(), CompressedInputSize);
+             const std::size_t count = static_cast<std::size_t>(s.file.gcount());
+
+             if(count == 0)
+             {
+                if(s.hint != 0) _error = "Unexpected end of zstd stream";
+                s.end = true;
+                break;
+             }
+
+             s.in = ZSTD_inBuffer{s.input.get(), count, 0};
+          }
+
+          s.hint = ZSTD_decompressStream(s.context, &out, &s.in);
+
+          if(ZSTD_isError(s.hint))
+          {
+             _error = ZSTD_getErrorName(s.hint);
+             s.end = true;
+          }
+    }
+
+    return out.pos;
+}
+
+#endif
+
+//-------------------------------------------------------------------------------------------
+
+static const char * const ControlCharacterDetectionMsg = "Control character detection, offset: ",
+                  * const InvalidEntryCharacterMsg = "Invalid entry character '",
+                  * const InvalidNameMsg = "Invalid name, offset: ",
+                  * const InvalidAttributeMsg = "Invalid attribute, offset: ",
+                  * const DuplicateAttributeMsg = "Duplicate attribute, offset: ",
+                  * const InvalidEndNodeMsg = "Invalid end node, offset: ",
+                  * const InvalidEntityMsg = "Invalid entity, offset: ",
+                  * const InvalidMarkupMsg = "Invalid markup, offset: ",
+                  * const MultipleRootMsg = "Multiple root nodes, offset: ",
+                  * const InvalidSequenceMsg = "Invalid UTF-8 sequence, offset: ",
+                  * const UnexpectedEndMsg = "Unexpected end of buffer, offset: ",
+                  * const EmptyDocumentMsg = "Empty document",
+                  * const ParseStoppedMsg = "Parse stopped, offset: ",
+                  * const ReadErrorMsg = "Read error, offset: ";
+
+static std::string makeError(const char * msg, XmlBufferReader & buffer)
+{
+    return  msg + std::to_string(buffer.offset());
+}
+
+static std::string makeError(const char * msg, unsigned char ch, XmlBufferReader & buffer)
+{
+    return std::string(msg) + static_cast<char>(ch) + "', offset: " + std::to_string(buffer.offset());
+}
+
+//-------------------------------------------------------------------------------------------
+
+static const char * findByte(const char * begin, const char * end, char byte)
+{
+#ifdef __SSE2__
+    const __m128i pattern = _mm_set1_epi8(byte);
+
+    for(; end - begin >= 16; begin += 16)
+    {
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(begin)), pattern));
+        if(mask != 0) return begin + std::countr_zero(static_cast<unsigned int>(mask));
+    }
+#endif
+
+    for(; begin != end; begin++){ if(*begin == byte) return begin; }
+    return end;
+}
+
+static char * writeUtf8(char * out, std::uint32_t code)
+{
+    if(code < 0x80)
+    {
+       *out++ = static_cast<char>(code);
+    }
+    else if(code < 0x800)
+    {
+       *out++ = static_cast<char>(0xC0 | (code >> 6));
+       *out++ = static_cast<char>(0x80 | (code & 0x3F));
+    }
+    else if(code < 0x10000)
+    {
+       *out++ = static_cast<char>(0xE0 | (code >> 12));
+       *out++ = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+       *out++ = static_cast<char>(0x80 | (code & 0x3F));
+    }
+    else
+    {
+       *out++ = static_cast<char>(0xF0 | (code >> 18));
+       *out++ = static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+       *out++ = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+       *out++ = static_cast<char>(0x80 | (code & 0x3F));
+    }
+
+    return out;
+}
+
+static bool decodeReference(std::string_view name, std::uint32_t & code)
+{
+    if(name == "lt") code = '<';
+    else if(name == "gt") code = '>';
+    else if(name == "amp") code = '&';
+    else if(name == "quot") code = '"';
+    else if(name == "apos") code = '\'';
+    else if(name.size() >= 2 && name[0] == '#')
+    {
+       const bool hex = (name[1] == 'x' || name[1] == 'X');
+       name.remove_prefix(hex ? 2 : 1);
+       if(name.empty() || name.size() > 8) return false;
+
+       code = 0;
+
+       for(unsigned char c : name)
+       {
+           if(c >= '0' && c <= '9') code = code * (hex ? 16 : 10) + (c - '0');
+           else if(hex && c >= 'a' && c <= 'f') code = code * 16 + (c - 'a' + 10);
+           else if(hex && c >= 'A' && c <= 'F') code = code * 16 + (c - 'A' + 10);
+           else return false;
+       }
+
+       if(code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF) || (code < 0x80 && isControlCode(code))) return false;
+    }
+    else return false;
+
+    return true;
+}
+
+//Decodes entities and character references of value[from, size) in place, returns npos or the position of the rejected reference.
+//A reference is never shorter than its UTF-8 encoding, so the output cursor can't overtake the input one.
+static std::size_t decodeEntities(std::string & value, std::size_t from, std::size_t & count)
+{
+    char * const data = value.data();
+    const char * in = data + from, * const end = data + value.size();
+
+    in = findByte(in, end, '&');
+    if(in == end) return std::string::npos;
+
+    char * out = const_cast<char *>(in);
+
+    while(in != end)
+    {
+          if(*in != '&')
+          {
+             const char * amp = findByte(in, end, '&');
+             std::memmove(out, in, static_cast<std::size_t>(amp - in));
+             out += amp - in;
+             in = amp;
+             continue;
+          }
+
+          const char * semicolon = findByte(in + 1, (end - in > 12) ? in + 12 : end, ';');
+          if(semicolon == end || *semicolon != ';') return static_cast<std::size_t>(in - data);
+
+          std::uint32_t code;
+          if(!decodeReference(std::string_view(in + 1, static_cast<std::size_t>(semicolon - in - 1)), code)) return static_cast<std::size_t>(in - data);
+
+          out = writeUtf8(out, code);
+          in = semicolon + 1;
+          count++;
+    }
+
+    value.resize(static_cast<std::size_t>(out - data));
+    return std::string::npos;
+}
+
+//-------------------------------------------------------------------------------------------
+
+static inline bool isNameBegin(unsigned char ch){ return (std::isalpha(ch) != 0 || ch == '_'); }
+static inline bool isNameChar(unsigned char ch){ return (std::isalnum(ch) != 0 || ch == ':' || ch == '-' || ch == '_' || ch == '.'); }
+
+class XmlParser final
+{
+    XmlSAXReader * self;
+    XmlBufferReader & buffer;
+    std::string & error;
+    bool & stop;
+    [[maybe_unused]] XmlStatistics & statistics;
+    std::vector<std::string> & names;
+    std::vector<std::string> & attributes;
+    std::string & text;
+
+    std::size_t level = 0;
+    unsigned char ch = 0;
+    bool opened = false; //The last tag read is a start tag, so the current node has no child nodes yet
+
+    bool fail(const char * msg)
+    {
+        error = makeError(msg, buffer);
+        return false;
+    }
+
+    bool stopped(){ return (stop) ? fail(ParseStoppedMsg) : false; }
+
+    //The buffer stops before a byte rejected by its block validation or where its input failed
+    bool rejected()
+    {
+        if(buffer.validation() <= XmlBufferReader::Valid) return false;
+        error = ((buffer.validation() == XmlBufferReader::ControlCharacter) ? ControlCharacterDetectionMsg :
+                 (buffer.validation() == XmlBufferReader::InvalidSequence) ? InvalidSequenceMsg : ReadErrorMsg) +
+                std::to_string(buffer.validationOffset());
+        return true;
+    }
+
+    bool next()
+    {
+        if(!buffer.next()) return (rejected()) ? false : fail(UnexpectedEndMsg);
+
+        ch = buffer.value();
+        if(buffer.validation() == XmlBufferReader::NotValidated && isControlCode(ch)) return fail(ControlCharacterDetectionMsg);
+        return true;
+    }
+
+    bool skipSpace()
+    {
+        while(std::isspace(ch) != 0){ if(!next()) return false; }
+        return true;
+    }
+
+    //Appends ch to a scratch string, counting its reallocations
+    void append(std::string & string)
+    {
+        XML_STATISTIC(const std::size_t capacity = string.capacity());
+        string.push_back(static_cast<char>(ch));
+        XML_STATISTIC(if(string.capacity() != capacity) statistics.bufferAllocations++);
+    }
+
+    //Returns the scratch string at index, counting the growth of the list
+    std::string & slot(std::vector<std::string> & strings, std::size_t index)
+    {
+        if(strings.size() == index)
+        {
+           XML_STATISTIC(if(strings.size() == strings.capacity()) statistics.bufferAllocations++);
+           strings.emplace_back();
+        }
+
+        return strings[index];
+    }
+
+    bool readName(std::string & name)
+    {
+        name.clear();
+        if(!isNameBegin(ch)) return fail(InvalidNameMsg);
+
+        do
+        {
+            append(name);
+            if(!next()) return false;
+        }
+        while(isNameChar(ch));
+
+        return true;
+    }
+
+    //Reads up to and including terminator, the content without terminator is appended to out if not null
+    bool readUntil(std::string_view terminator, std::string * out)
+    {
+        std::size_t matched = 0;
+        std::size_t start = (out != nullptr) ? out->size() : 0;
+
+        while(matched < terminator.size())
+        {
+              if(!next()) return false;
+              if(out != nullptr) append(*out);
+
+              if(ch == static_cast<unsigned char>(terminator[matched])) matched++;
+              else if(ch == static_cast<unsigned char>(terminator[0])) matched = (terminator[0] == terminator[1] && matched > 1) ? matched : 1;
+              else matched = 0;
+        }
+
+        if(out != nullptr) out->resize(std::max(start, out->size() - terminator.size()));
+        return true;
+    }
+
+    bool expect(std::string_view string)
+    {
+        for(char c : string)
+        {
+            if(!next()) return false;
+            if(ch != static_cast<unsigned char>(c)) return fail(InvalidMarkupMsg);
+        }
+
+        return true;
+    }
+
+    //ch == '!' or '?', skips processing instructions, comments and doctype; CDATA is appended to text
+    bool skipMarkup(std::size_t & decoded)
+    {
+        if(ch == '?') return readUntil("?>", nullptr);
+        if(!next()) return false;
+
+        if(ch == '-') return expect("-") && readUntil("-->", nullptr);
+
+        if(ch == '[')
+        {
+           if(level == 0 || !expect("CDATA[")) return (level == 0) ? fail(InvalidMarkupMsg) : false;
+           if(!readUntil("]]>", &text)) return false;
+           decoded = text.size();
+           return true;
+        }
+
+        if(level > 0) return fail(InvalidMarkupMsg);
+
+        int brackets = 0;
+
+        while(ch != '>' || brackets > 0)
+        {
+              if(ch == '[') brackets++;
+              else if(ch == ']') brackets--;
+              if(!next()) return false;
+        }
+
+        return true;
+    }
+
+    //Decodes text[from, size) read as one run of the stream that ends before offset end
+    bool decode(std::size_t from, std::size_t end)
+    {
+        [[maybe_unused]] std::size_t count = 0;
+        const std::size_t rejected = decodeEntities(text, from, count);
+
+        if(rejected != std::string::npos)
+        {
+           error = InvalidEntityMsg + std::to_string(end - (text.size() - rejected));
+           return false;
+        }
+
+        XML_STATISTIC(statistics.entities += count);
+        return true;
+    }
+
+    //Blank text is indentation unless it is the whole content of a node
+    bool flushText(std::size_t decoded, bool whole)
+    {
+        if(text.empty()) return true;
+
+        bool blank = true;
+        for(unsigned char c : text){ if(std::isspace(c) == 0){ blank = false; break; } }
+
+        if(!blank || whole)
+        {
+           if(!decode(decoded, buffer.offset() - 1)) return false;
+           self->Value(text);
+           if(stop) return stopped();
+        }
+
+        text.clear();
+        return true;
+    }
+
+    bool readAttributeValue()
+    {
+        const unsigned char quote = ch;
+        if(quote != '"' && quote != '\'') return fail(InvalidAttributeMsg);
+
+        text.clear();
+
+        while(true)
+        {
+              if(!next()) return false;
+              if(ch == quote) break;
+              if(ch == '<') return fail(InvalidAttributeMsg);
+              append(text);
+        }
+
+        return decode(0, buffer.offset());
+    }
+
+    bool startNode()
+    {
+        std::string & name = slot(names, level);
+
+        if(!readName(name)) return false;
+
+        self->NodeBegin(name);
+        if(stop) return stopped();
+        XML_STATISTIC(statistics.elements++);
+        XML_STATISTIC(statistics.maxDepth = std::max(statistics.maxDepth, level + 1));
+
+        std::size_t count = 0;
+
+        while(true)
+        {
+              const bool space = (std::isspace(ch) != 0);
+              if(!skipSpace()) return false;
+
+              if(ch == '/')
+              {
+                 if(!expect(">")) return false;
+                 opened = false;
+                 self->NodeEnd();
+                 return (stop) ? stopped() : true;
+              }
+
+              if(ch == '>')
+              {
+                 level++;
+                 opened = true;
+                 return true;
+              }
+
+              if(!space) return fail(InvalidAttributeMsg);
+
+              if(!readName(slot(attributes, count))) return false;
+
+              for(std::size_t i = 0; i < count; i++){ if(attributes[i] == attributes[count]) return fail(DuplicateAttributeMsg); }
+
+              self->AttributeName(attributes[count]);
+              if(stop) return stopped();
+              XML_STATISTIC(statistics.attributes++);
+              count++;
+
+              if(!skipSpace()) return false;
+              if(ch != '=') return fail(InvalidAttributeMsg);
+              if(!next() || !skipSpace() || !readAttributeValue()) return false;
+
+              self->AttributeValue(text);
+              if(stop) return stopped();
+              text.clear();
+
+              if(!next()) return false;
+        }
+    }
+
+    bool endNode()
+    {
+        if(!next()) return false;
+        if(!readName(slot(names, level))) return false;
+        if(names[level] != names[level - 1]) return fail(InvalidEndNodeMsg);
+        if(!skipSpace()) return false;
+        if(ch != '>') return fail(InvalidEndNodeMsg);
+
+        level--;
+        opened = false;
+        self->NodeEnd();
+        return (stop) ? stopped() : true;
+    }
+
+    //Reads a document element, ch is the first character of the root node name
+    bool readNode()
+    {
+        std::size_t decoded = 0;
+
+        if(!startNode()) return false;
+        text.clear();
+
+        while(level > 0)
+        {
+              if(!next()) return false;
+
+              if(ch != '<')
+              {
+                 append(text);
+                 continue;
+              }
+
+              if(!next()) return false;
+
+              //Text before markup is decoded on its own, a reference can't span the markup
+              if(ch == '!' || ch == '?')
+              {
+                 if(!decode(decoded, buffer.offset() - 1)) return false;
+                 decoded = text.size();
+                 if(!skipMarkup(decoded)) return false;
+                 continue;
+              }
+
+              if(!flushText(decoded, ch == '/' && opened)) return false;
+              decoded = 0;
+
+              if(ch == '/')
+              {
+                 if(!endNode()) return false;
+              }
+              else if(!startNode()) return false;
+        }
+
+        return true;
+    }
+
+public:
+    explicit XmlParser(XmlSAXReader * self, XmlBufferReader & buffer, std::string & error, bool & stop, XmlStatistics & statistics,
+                       std::vector<std::string> & names, std::vector<std::string> & attributes, std::string & text):
+        self(self), buffer(buffer), error(error), stop(stop), statistics(statistics), names(names), attributes(attributes), text(text){}
+
+    bool parse(XmlSAXReader::Operation operation)
+    {
+        std::size_t documents = 0, unused = 0;
+
+        while(buffer.next())
+        {
+              ch = buffer.value();
+
+              if(std::isspace(ch) != 0) continue;
+
+              if(buffer.validation() == XmlBufferReader::NotValidated && isControlCode(ch)) return fail(ControlCharacterDetectionMsg);
+
+              if(ch != '<')
+              {
+                 error = makeError(InvalidEntryCharacterMsg, ch, buffer);
+                 return false;
+              }
+
+              if(!next()) return false;
+
+              if(ch == '!' || ch == '?')
+              {
+                 if(!skipMarkup(unused)) return false;
+                 continue;
+              }
+
+              if(documents > 0 && operation == XmlSAXReader::Single) return fail(MultipleRootMsg);
+
+              self->XmlBegin();
+              if(stop) return stopped();
+
+              if(!readNode()) return false;
+
+              self->XmlEnd();
+              if(stop) return stopped();
+              documents++;
+        }
+
+        if(rejected()) return false;
+
+        if(documents == 0)
+        {
+           error = EmptyDocumentMsg;
+           return false;
+        }
+
+        return true;
+    }
+};
+
+//----------------------------------------------------------------
+
+void XmlSAXReader::stopParse(){ stop = true; }
+
+XmlSAXReader::XmlSAXReader(){}
+XmlSAXReader::~XmlSAXReader(){}
+
+std::string XmlSAXReader::error() const{ return std::move(_error); }
+
+const XmlStatistics & XmlSAXReader::statistics() const { return _statistics; }
+
+bool XmlSAXReader::parse(XmlBufferReader & buffer, Operation operation)
+{
+    _statistics.clear();
+
+#ifdef XML_STATISTICS
+    const XmlStatistics io = buffer.statistics();
+    bool ret;
+
+    {
+        XML_TRACE_SCOPE(XmlTrace::Parse, _statistics.parseTime);
+        ret = parseBuffer(buffer, operation);
+    }
+
+    _statistics.bytes = buffer.offset();
+    _statistics.ioTime = buffer.statistics().ioTime - io.ioTime;
+    _statistics.bufferAllocations += buffer.statistics().bufferAllocations - io.bufferAllocations;
+    return ret;
+#else
+    return parseBuffer(buffer, operation);
+#endif
+}
+
+bool XmlSAXReader::parseBuffer(XmlBufferReader & buffer, Operation operation)
+{
+    stop = false;
+    _error.clear();
+    XmlParser parser(this, buffer, _error, stop, _statistics, names, attributes, text);
+    return parser.parse(operation);
+}
+
+//-------------------------------------------------------------------------------------------
+
+XmlNode::XmlNode():XmlNode(std::make_shared<XmlData>()){}
+XmlNode::XmlNode(std::shared_ptr<XmlData> data):cell(std::make_shared<XmlCell>())
+{
+    cell->data = std::move(data);
+}
+XmlNode::XmlNode(std::shared_ptr<XmlCell> cell):cell(std::move(cell)){}
+XmlNode::XmlNode(const char * nodeName, bool sort):XmlNode(std::string_view(nodeName), sort){}
+XmlNode::XmlNode(std::string_view nodeName, bool sort):XmlNode()
+{
+    cell->data->sort = sort;
+    cell->data->name = nodeName;
+}
+XmlNode::XmlNode(const std::string & nodeName, bool sort):XmlNode()
+{
+    cell->data->sort = sort;
+    cell->data->name = nodeName;
+}
+XmlNode::XmlNode(std::string && nodeName, bool sort):XmlNode()
+{
+    cell->data->sort = sort;
+    cell->data->name = std::move(nodeName);
+}
+
+//Deep trees are released level by level, a recursive release could run out of stack
+XmlNode::XmlData::~XmlData()
+{
+    Contents pending = std::move(childs);
+
+    while(!pending.empty())
+    {
+          std::shared_ptr<XmlData> data = std::move(pending.back());
+          pending.pop_back();
+          if(data.use_count() != 1) continue;
+
+          for(auto & child : data->childs) pending.push_back(std::move(child));
+          data->childs.clear();
+    }
+}
+
+XmlNode::XmlCell::~XmlCell()
+{
+    std::vector<std::unique_ptr<Childs>> pending;
+    pending.emplace_back(childs.load(std::memory_order_relaxed));
+
+    while(!pending.empty())
+    {
+          const std::unique_ptr<Childs> childs = std::move(pending.back());
+          pending.pop_back();
+          if(!childs) continue;
+
+          for(const auto & child : *childs){ if(child.cell.use_count() == 1) pending.emplace_back(child.cell->childs.exchange(nullptr, std::memory_order_relaxed)); }
+    }
+}
+
+//Clones the contents still shared with other trees from the root down to this node and drops their cached hashes and fragments
+XmlNode::XmlData & XmlNode::detach() const
+{
+    std::vector<std::shared_ptr<XmlCell>> path{cell};
+    while(std::shared_ptr<XmlCell> parent = path.back()->parent.lock()) path.push_back(std::move(parent));
+
+    XmlData * parent = nullptr;
+
+    for(auto iter = path.rbegin(); iter != path.rend(); iter++)
+    {
+        XmlCell & current = **iter;
+
+        //Owned by the cell and by the childs of the parent content, any other owner is a copy
+        if(current.data.use_count() > ((parent) ? 2 : 1))
+        {
+           current.data = std::make_shared<XmlData>(*current.data);
+           if(parent) parent->childs[current.index] = current.data;
+        }
+
+        current.data->hash.value.store(0, std::memory_order_relaxed);
+        current.data->fragment.clear();
+        parent = current.data.get();
+    }
+
+    return *cell->data;
+}
+
+//Threads reading the same node may make the handles at once, the first ones made are kept
+XmlNode::Childs & XmlNode::handles() const
+{
+    Childs * ret = cell->childs.load(std::memory_order_acquire);
+    if(ret) return *ret;
+
+    std::unique_ptr<Childs> childs = std::make_unique<Childs>();
+    std::size_t index = 0;
+
+    for(const auto & data : cell->data->childs)
+    {
+        std::shared_ptr<XmlCell> child = std::make_shared<XmlCell>();
+        child->parent = cell;
+        child->data = data;
+        child->index = index++;
+        childs->push_back(XmlNode(std::move(child)));
+    }
+
+    if(cell->childs.compare_exchange_strong(ret, childs.get(), std::memory_order_acq_rel, std::memory_order_acquire)) ret = childs.release();
+    return *ret;
+}
+
+std::shared_ptr<XmlNode::XmlCell> XmlNode::root() const
+{
+    std::shared_ptr<XmlCell> ret = cell;
+    while(std::shared_ptr<XmlCell> parent = ret->parent.lock()) ret = std::move(parent);
+    return ret;
+}
+
+//A cell is in one tree at one place, a node that has a parent is stored as a copy.
+//So is the root, the copy is taken before the change and the tree stays free of cycles.
+XmlNode XmlNode::adopt(const XmlNode & node, const std::shared_ptr<XmlCell> & root)
+{
+    return (!node.cell->parent.expired() || node.cell == root) ? node.copy() : node;
+}
+
+//Stores the contents of the handles in their order, every handle keeps its position
+void XmlNode::store(XmlData & data, Childs & childs)
+{
+    data.childs.clear();
+    data.childs.reserve(childs.size());
+
+    for(auto & child : childs)
+    {
+        child.cell->index = data.childs.size();
+        data.childs.push_back(child.cell->data);
+    }
+}
+
+//The handles made before are left roots
+void XmlNode::clearChilds(XmlData & data) const
+{
+    if(Childs * childs = cell->childs.load(std::memory_order_relaxed))
+    {
+       for(auto & child : *childs) child.cell->parent.reset();
+       childs->clear();
+    }
+
+    data.childs.clear();
+}
+
+//Adds the node as the last child or in order of the names, returns the handle stored
+XmlNode XmlNode::append(XmlNode node)
+{
+    if(!node.isValid()) return XmlNode();
+    node = adopt(node, root());
+
+    XmlData & data = detach();
+    Childs & childs = handles();
+    data.value.clear();
+    node.cell->parent = cell;
+    node.cell->index = data.childs.size();
+    data.childs.push_back(node.cell->data);
+    childs.push_back(node);
+
+    if(data.sort)
+    {
+       childs.sort();
+       store(data, childs);
+    }
+
+    return node;
+}
+
+bool XmlNode::isValid() const { return !cell->data->name.empty(); }
+const std::string & XmlNode::nodeName() const { return cell->data->name; }
+XmlNode XmlNode::parent() const
+{
+    std::shared_ptr<XmlCell> parent = cell->parent.lock();
+    return (parent) ? XmlNode(std::move(parent)) : XmlNode();
+}
+XmlNode XmlNode::copy() const { return XmlNode(cell->data); }
+std::size_t XmlNode::attributesCount() const { return cell->data->attributes.size(); }
+const XmlNode::Attributes & XmlNode::attributes() const { return cell->data->attributes; }
+XmlNode::operator const Attributes & () const{ return cell->data->attributes; }
+void XmlNode::setAttributes(const Attributes & attributes){ detach().attributes = attributes; }
+void XmlNode::setAttributes(Attributes && attributes){ detach().attributes = std::move(attributes); }
+bool XmlNode::containsAttribute(std::string_view attributeName) const{ return cell->data->attributes.contains(attributeName); }
+std::string XmlNode::attributeValue(std::string_view attributeName) const
+{
+    auto iter = cell->data->attributes.find(attributeName);
+    return (iter != cell->data->attributes.end()) ? iter->second : std::string();
+}
+void XmlNode::addAttribute(const char * attributeName, const char * value){ addAttribute(std::string_view(attributeName), std::string_view(value)); }
+void XmlNode::addAttribute(std::string_view attributeName, std::string_view value)
+{
+    Attributes & attributes = detach().attributes;
+    auto iter = attributes.lower_bound(attributeName);
+    if(iter != attributes.end() && iter->first == attributeName) iter->second = value;
+    else attributes.emplace_hint(iter, attributeName, value);
+}
+void XmlNode::addAttribute(const std::string & attributeName, const std::string & value){ detach().attributes[attributeName] = value; }
+void XmlNode::addAttribute(std::string && attributeName, std::string && value){ detach().attributes.insert_or_assign(std::move(attributeName), std::move(value)); }
+void XmlNode::removeAttribute(std::string_view attributeName)
+{
+    Attributes & attributes = detach().attributes;
+    auto iter = attributes.find(attributeName);
+    if(iter != attributes.end()) attributes.erase(iter);
+}
+void XmlNode::clearAttributes(){ detach().attributes.clear(); }
+
+bool XmlNode::isValue() const { return !cell->data->value.empty(); }
+const std::string & XmlNode::value() const { return cell->data->value; }
+XmlNode::operator const std::string &() const { return cell->data->value; }
+void XmlNode::setValue(const char * value)
+{
+    XmlData & data = detach();
+    clearChilds(data);
+    data.value = value;
+}
+void XmlNode::setValue(std::string_view value)
+{
+    XmlData & data = detach();
+    clearChilds(data);
+    data.value = value;
+}
+void XmlNode::setValue(const std::string & value)
+{
+    XmlData & data = detach();
+    clearChilds(data);
+    data.value = value;
+}
+void XmlNode::setValue(std::string && value)
+{
+    XmlData & data = detach();
+    clearChilds(data);
+    data.value = std::move(value);
+}
+bool XmlNode::isChilds() const { return !cell->data->childs.empty(); }
+std::size_t XmlNode::childsCount() const { return cell->data->childs.size(); }
+const XmlNode::Childs & XmlNode::childs() const { return handles(); }
+XmlNode::operator const Childs & () const { return handles(); }
+void XmlNode::setChilds(const Childs & childs){ setChilds(Childs(childs)); }
+void XmlNode::setChilds(Childs && childs)
+{
+    Childs nodes = std::move(childs);
+    XmlData & data = detach();
+    data.value.clear();
+    clearChilds(data);
+
+    //The childs replaced are roots now and can come back, a node given twice is stored once and then as a copy
+    const std::shared_ptr<XmlCell> top = root();
+    Childs & handles = this->handles();
+
+    for(const auto & child : nodes)
+    {
+        handles.push_back(adopt(child, top));
+        handles.back().cell->parent = cell;
+    }
+
+    if(data.sort) handles.sort();
+    store(data, handles);
+}
+bool XmlNode::containsChild(std::string_view nodeName) const
+{
+    for(const auto & child : cell->data->childs){ if(child->name == nodeName) return true; }
+    return false;
+}
+std::vector<XmlNode> XmlNode::child(std::string_view nodeName) const
+{
+    std::vector<XmlNode> ret;
+    for(const auto & child : handles()){ if(child.cell->data->name == nodeName) ret.push_back(child); }
+    return ret;
+}
+bool XmlNode::addChild(const XmlNode & node){ return append(node).isValid(); }
+bool XmlNode::addChild(XmlNode && node){ return append(std::move(node)).isValid(); }
+void XmlNode::removeChild(std::string_view nodeName)
+{
+    XmlData & data = detach();
+    Childs & childs = handles();
+
+    const std::size_t count = childs.remove_if([&](const XmlNode & child)
+    {
+        if(child.cell->data->name != nodeName) return false;
+        child.cell->parent.reset();
+        return true;
+    });
+
+    if(count > 0) store(data, childs);
+}
+
+bool XmlNode::operator<(const XmlNode & other) const{ return (cell->data->name < other.cell->data->name); }
+
+static inline void combineHash(std::size_t & seed, std::size_t value)
+{
+    seed ^= value + 0x9e3779b97f4a7c15ull + (seed << 12) + (seed >> 4);
+}
+
+std::size_t XmlNode::hash() const
+{
+    XmlData * const root = cell->data.get();
+    std::size_t ret = root->hash.value.load(std::memory_order_relaxed);
+    if(ret != 0) return ret;
+
+    //Post order, only subtrees without a cached hash are entered
+    const std::hash<std::string> hasher;
+    std::vector<std::pair<XmlData *, Contents::const_iterator>> stack{{root, root->childs.cbegin()}};
+
+    while(!stack.empty())
+    {
+          XmlData * const data = stack.back().first;
+
+          if(stack.back().second != data->childs.cend())
+          {
+             XmlData * const child = (stack.back().second++)->get();
+             if(child->hash.value.load(std::memory_order_relaxed) == 0) stack.push_back({child, child->childs.cbegin()});
+             continue;
+          }
+
+          std::size_t seed = hasher(data->name);
+          combineHash(seed, hasher(data->value));
+          combineHash(seed, data->attributes.size());
+
+          for(const auto & pair : data->attributes)
+          {
+              combineHash(seed, hasher(pair.first));
+              combineHash(seed, hasher(pair.second));
+          }
+
+          combineHash(seed, data->childs.size());
+          for(const auto & child : data->childs) combineHash(seed, child->hash.value.load(std::memory_order_relaxed));
+
+          //0 marks a hash not computed yet
+          if(seed == 0) seed = 1;
+          data->hash.value.store(seed, std::memory_order_relaxed);
+          stack.pop_back();
+    }
+
+    return root->hash.value.load(std::memory_order_relaxed);
+}
+
+bool XmlNode::equals(const XmlNode & other) const
+{
+    if(hash() != other.hash()) return false;
+
+    struct Level
+    {
+        const XmlData * first, * second;
+        Contents::const_iterator iter, otherIter;
+        bool entered;
+    };
+
+    std::vector<Level> stack{{cell->data.get(), other.cell->data.get(), {}, {}, false}};
+
+    while(!stack.empty())
+    {
+          Level & level = stack.back();
+
+          if(!level.entered)
+          {
+             const XmlData & first = *level.first, & second = *level.second;
+
+             if(&first == &second)
+             {
+                stack.pop_back();
+                continue;
+             }
+
+             if(first.hash.value.load(std::memory_order_relaxed) != second.hash.value.load(std::memory_order_relaxed) ||
+                first.name != second.name || first.value != second.value ||
+                first.attributes != second.attributes || first.childs.size() != second.childs.size()) return false;
+
+             level.entered = true;
+             level.iter = first.childs.cbegin();
+             level.otherIter = second.childs.cbegin();
+          }
+
+          if(level.iter == level.first->childs.cend())
+          {
+             stack.pop_back();
+             continue;
+          }
+
+          const XmlData * const first = (level.iter++)->get();
+          const XmlData * const second = (level.otherIter++)->get();
+          stack.push_back({first, second, {}, {}, false});
+    }
+
+    return true;
+}
+
+std::vector<XmlDifference> XmlNode::diff(const XmlNode & other) const
+{
+    std::vector<XmlDifference> ret;
+    std::vector<std::pair<XmlNode, XmlNode>> pending{{*this, other}};
+
+    while(!pending.empty())
+    {
+          const XmlNode before = std::move(pending.back().first), after = std::move(pending.back().second);
+          pending.pop_back();
+
+          const XmlData & first = *before.cell->data, & second = *after.cell->data;
+          if(&first == &second || before.hash() == after.hash()) continue;
+
+          if(first.name != second.name)
+          {
+             ret.push_back({XmlDifference::Changed, before, after});
+             continue;
+          }
+
+          const std::size_t count = ret.size();
+          const bool changed = (first.value != second.value || first.attributes != second.attributes);
+          if(changed) ret.push_back({XmlDifference::Changed, before, after});
+
+          //The differences hold handles that change the trees of before and after
+          const Childs & firstChilds = before.childs(), & secondChilds = after.childs();
+          std::vector<const XmlNode *> seconds;
+          std::unordered_map<std::size_t, std::vector<std::size_t>> hashes;
+
+          for(const auto & child : secondChilds)
+          {
+              hashes[child.hash()].push_back(seconds.size());
+              seconds.push_back(&child);
+          }
+
+          //Equal subtrees first, whatever moved around them
+          std::vector<bool> used(seconds.size(), false);
+          std::unordered_map<std::size_t, std::size_t> cursors;
+          std::vector<const XmlNode *> rest;
+
+          for(const auto & child : firstChilds)
+          {
+              const std::size_t hash = child.hash();
+              auto iter = hashes.find(hash);
+              std::size_t & cursor = cursors[hash];
+
+              if(iter != hashes.end() && cursor < iter->second.size()) used[iter->second[cursor++]] = true;
+              else rest.push_back(&child);
+          }
+
+          //Then the remaining childs of the same name in order
+          std::map<std::string_view, std::vector<std::size_t>> names;
+          for(std::size_t i = seconds.size(); i-- > 0;){ if(!used[i]) names[seconds[i]->nodeName()].push_back(i); }
+
+          std::vector<std::pair<XmlNode, XmlNode>> pairs;
+
+          for(const XmlNode * child : rest)
+          {
+              auto iter = names.find(child->nodeName());
+
+              if(iter != names.end() && !iter->second.empty())
+              {
+                 used[iter->second.back()] = true;
+                 pairs.push_back({*child, *seconds[iter->second.back()]});
+                 iter->second.pop_back();
+              }
+              else ret.push_back({XmlDifference::Removed, *child, XmlNode()});
+          }
+
+          for(std::size_t i = 0; i < seconds.size(); i++){ if(!used[i]) ret.push_back({XmlDifference::Added, XmlNode(), *seconds[i]}); }
+
+          //Same content and childs, only their order differs
+          if(!changed && ret.size() == count && pairs.empty()) ret.push_back({XmlDifference::Changed, before, after});
+
+          pending.insert(pending.end(), std::make_move_iterator(pairs.rbegin()), std::make_move_iterator(pairs.rend()));
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------
+
+XmlReader::XmlReader(){}
+
+void XmlReader::XmlBegin()
+{
+    root = XmlNode();
+    stack.clear();
+}
+
+void XmlReader::XmlEnd(){}
+
+//The contents are new and held by nobody else, they are filled in place without the copy on write of the mutators
+void XmlReader::NodeBegin(const std::string & name)
+{
+    std::shared_ptr<XmlNode::XmlData> data = std::make_shared<XmlNode::XmlData>();
+    data->name = name;
+
+    if(stack.empty()) root = XmlNode(data);
+    else
+    {
+       stack.back()->value.clear();
+       stack.back()->childs.push_back(data);
+    }
+
+    stack.push_back(data.get());
+}
+
+void XmlReader::AttributeName(const std::string & name){ attribute = name; }
+void XmlReader::AttributeValue(const std::string & value){ stack.back()->attributes.insert_or_assign(attribute, value); }
+
+void XmlReader::Value(const std::string & value)
+{
+    if(stack.back()->childs.empty()) stack.back()->value = value;
+}
+
+void XmlReader::NodeEnd(){ stack.pop_back(); }
+
+bool XmlReader::read(XmlBufferReader & buffer, XmlNode & node)
+{
+    if(!parse(buffer, Single))
+    {
+       root = XmlNode();
+       stack.clear();
+       return false;
+    }
+
+    node = root;
+    root = XmlNode();
+    return true;
+}
+
+bool XmlReader::read(std::string_view xml, XmlNode & node)
+{
+    XmlStringViewBufferReader buffer(xml);
+    return read(buffer, node);
+}
+
+XmlNode XmlReader::read(std::string_view xml)
+{
+    XmlNode ret;
+    read(xml, ret);
+    return ret;
+}
+
+bool XmlReader::readFromFile(const std::string & fileName, XmlNode & node)
+{
+    XmlFileBufferReader buffer;
+    if(!buffer.open(fileName) || !read(buffer, node)) return false;
+    return true;
+}
+
+//-----------------------------------------------------------
+
+XmlFrozenNode::XmlFrozenNode(){}
+XmlFrozenNode::XmlFrozenNode(const XmlFrozenDocument * document, std::size_t index):document(document), index(index){}
+
+bool XmlFrozenNode::isValid() const { return document != nullptr; }
+std::string_view XmlFrozenNode::nodeName() const
+{
+    if(document == nullptr) return std::string_view();
+    const XmlFrozenDocument::Node & node = document->nodes[index];
+    return document->string(node.name, node.nameSize);
+}
+XmlFrozenNode XmlFrozenNode::parent() const
+{
+    if(document == nullptr || document->nodes[index].parent == std::string::npos) return XmlFrozenNode();
+    return XmlFrozenNode(document, document->nodes[index].parent);
+}
+
+std::size_t XmlFrozenNode::attributesCount() const { return (document == nullptr) ? 0 : document->nodes[index].attributesCount; }
+std::pair<std::string_view, std::string_view> XmlFrozenNode::attribute(std::size_t index) const
+{
+    if(index >= attributesCount()) return {};
+    const XmlFrozenDocument::Attribute & attribute = document->attributes[document->nodes[this->index].attributes + index];
+    return {document->string(attribute.name, attribute.nameSize), document->string(attribute.value, attribute.valueSize)};
+}
+bool XmlFrozenNode::containsAttribute(std::string_view attributeName) const
+{
+    for(std::size_t i = 0; i < attributesCount(); i++){ if(attribute(i).first == attributeName) return true; }
+    return false;
+}
+std::string_view XmlFrozenNode::attributeValue(std::string_view attributeName) const
+{
+    for(std::size_t i = 0; i < attributesCount(); i++)
+    {
+        const auto pair = attribute(i);
+        if(pair.first == attributeName) return pair.second;
+    }
+
+    return std::string_view();
+}
+
+bool XmlFrozenNode::isValue() const { return document != nullptr && document->nodes[index].valueSize > 0; }
+std::string_view XmlFrozenNode::value() const
+{
+    if(document == nullptr) return std::string_view();
+    const XmlFrozenDocument::Node & node = document->nodes[index];
+    return document->string(node.value, node.valueSize);
+}
+
+bool XmlFrozenNode::isChilds() const { return childsCount() > 0; }
+std::size_t XmlFrozenNode::childsCount() const { return (document == nullptr) ? 0 : document->nodes[index].childsCount; }
+XmlFrozenNode XmlFrozenNode::child(std::size_t index) const
+{
+    if(index >= childsCount()) return XmlFrozenNode();
+    return XmlFrozenNode(document, document->nodes[this->index].childs + index);
+}
+XmlFrozenNode XmlFrozenNode::child(std::string_view nodeName) const
+{
+    for(std::size_t i = 0; i < childsCount(); i++)
+    {
+        XmlFrozenNode node = child(i);
+        if(node.nodeName() == nodeName) return node;
+    }
+
+    return XmlFrozenNode();
+}
+bool XmlFrozenNode::containsChild(std::string_view nodeName) const { return child(nodeName).isValid(); }
+
+//------------------
+
+XmlFrozenDocument::XmlFrozenDocument(){}
+
+XmlFrozenDocument::XmlFrozenDocument(const XmlNode & node)
+{
+    if(!node.isValid()) return;
+
+    //Breadth first, so the children of every node are appended next to each other
+    std::vector<const XmlNode::XmlData *> datas{node.cell->data.get()};
+    nodes.push_back({std::string::npos, 0, 0, 0, 0, 0, 0, 0, 0});
+
+    const auto add = [this](const std::string & string)
+    {
+        const std::size_t offset = strings.size();
+        strings.append(string);
+        return offset;
+    };
+
+    for(std::size_t i = 0; i < nodes.size(); i++)
+    {
+        const XmlNode::XmlData & data = *datas[i];
+
+        nodes[i].name = add(data.name);
+        nodes[i].nameSize = data.name.size();
+        nodes[i].value = add(data.value);
+        nodes[i].valueSize = data.value.size();
+        nodes[i].attributes = attributes.size();
+        nodes[i].attributesCount = data.attributes.size();
+
+        for(const auto & pair : data.attributes)
+        {
+            const std::size_t name = add(pair.first);
+            attributes.push_back({name, pair.first.size(), add(pair.second), pair.second.size()});
+        }
+
+        nodes[i].childs = nodes.size();
+
+        for(const auto & child : data.childs)
+        {
+            nodes.push_back({i, 0, 0, 0, 0, 0, 0, 0, 0});
+            datas.push_back(child.get());
+            nodes[i].childsCount++;
+        }
+    }
+}
+
+bool XmlFrozenDocument::isValid() const { return !nodes.empty(); }
+XmlFrozenNode XmlFrozenDocument::root() const { return (nodes.empty()) ? XmlFrozenNode() : XmlFrozenNode(this, 0); }
+std::size_t XmlFrozenDocument::nodesCount() const { return nodes.size(); }
+
+//------------------
+
+XmlSnapshot::XmlSnapshot():current(std::make_shared<const XmlFrozenDocument>()){}
+XmlSnapshot::XmlSnapshot(const XmlNode & node):current(std::make_shared<const XmlFrozenDocument>(node)){}
+
+void XmlSnapshot::publish(const XmlNode & node){ publish(std::make_shared<const XmlFrozenDocument>(node)); }
+
+void XmlSnapshot::publish(std::shared_ptr<const XmlFrozenDocument> document)
+{
+    if(!document) document = std::make_shared<const XmlFrozenDocument>();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.swap(document);
+    }
+
+    version.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const XmlFrozenDocument> XmlSnapshot::load() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return current;
+}
+
+XmlSnapshot::Reader::Reader(const XmlSnapshot & snapshot):snapshot(snapshot)
+{
+    //The version is read first, a publish in between is seen again by the next refresh()
+    version = snapshot.version.load(std::memory_order_acquire);
+    current = snapshot.load();
+}
+
+bool XmlSnapshot::Reader::refresh()
+{
+    const std::size_t published = snapshot.version.load(std::memory_order_acquire);
+    if(published == version) return false;
+
+    version = published;
+    current = snapshot.load();
+    return true;
+}
+
+const XmlFrozenDocument & XmlSnapshot::Reader::document() const { return *current; }
+XmlFrozenNode XmlSnapshot::Reader::root() const { return current->root(); }
+
+//-----------------------------------------------------------
+
+XmlIndex::XmlIndex(){}
+
+XmlIndex::XmlIndex(const XmlNode & node){ build(node); }
+
+void XmlIndex::build(const XmlNode & node)
+{
+    nodes.clear();
+    names.clear();
+    cells.clear();
+
+    if(!node.isValid()) return;
+
+    struct Level
+    {
+        std::size_t index;
+        XmlNode::Childs::const_iterator iter, end;
+    };
+
+    std::vector<Level> stack;
+
+    const auto add = [&](const XmlNode & node, std::size_t parent)
+    {
+        const std::size_t index = nodes.size();
+        nodes.push_back({node, parent, 0});
+        cells.emplace(node.cell.get(), index);
+
+        auto iter = names.find(node.nodeName());
+        if(iter == names.end()) iter = names.emplace(node.nodeName(), std::vector<std::size_t>()).first;
+        iter->second.push_back(index);
+
+        const XmlNode::Childs & childs = node.childs();
+        stack.push_back({index, childs.begin(), childs.end()});
+    };
+
+    add(node, std::string::npos);
+
+    while(!stack.empty())
+    {
+          Level & level = stack.back();
+
+          if(level.iter == level.end)
+          {
+             nodes[level.index].end = nodes.size();
+             stack.pop_back();
+             continue;
+          }
+
+          const XmlNode & child = *level.iter++;
+          add(child, level.index);
+    }
+}
+
+bool XmlIndex::isValid() const { return !nodes.empty(); }
+XmlNode XmlIndex::root() const { return (nodes.empty()) ? XmlNode() : nodes.front().node; }
+std::size_t XmlIndex::nodesCount() const { return nodes.size(); }
+
+std::size_t XmlIndex::find(const XmlNode & node) const
+{
+    auto iter = cells.find(node.cell.get());
+    return (iter != cells.end()) ? iter->second : std::string::npos;
+}
+
+//------------------
 
-std::size_t XmlFileBufferReader::offset(){ return pos; }
+static const char * const EmptyQueryMsg = "Empty query",
+                  * const InvalidStepMsg = "Invalid step, offset: ",
+                  * const InvalidAxisMsg = "Invalid axis, offset: ",
+                  * const InvalidPredicateMsg = "Invalid predicate, offset: ",
+                  * const UnexpectedQueryCharacterMsg = "Unexpected character, offset: ";
 
-//-------------------------------------------------------------------------------------------
+XmlQuery::XmlQuery(){}
 
-static const char * const ControlCharacterDetectionMsg = "Control character detection, offset: ",
-                  * const InvalidEntryCharacterMsg = "Invalid entry character '";
+XmlQuery::XmlQuery(std::string_view expression){ compile(expression); }
 
-static std::string makeError(const char * msg, XmlBufferReader & buffer)
+bool XmlQuery::compile(std::string_view expression)
 {
-    return  msg + std::to_string(buffer.offset());
-}
+    steps.clear();
+    absolute = false;
+    _error.clear();
 
-static std::string makeError(const char * msg, unsigned char ch, XmlBufferReader & buffer)
-{
-    return std::string(msg) + static_cast<const char>(ch) + "', offset: " + std::to_string(buffer.offset());
-}
+    std::size_t pos = 0;
 
-//-------------------------------------------------------------------------------------------
+    const auto fail = [&](const char * msg)
+    {
+        _error = msg + std::to_string(pos);
+        steps.clear();
+        return false;
+    };
 
-enum class XmlReaderType : unsigned char
-{
-    NodeBegin = 0,
-    NodeAttribute,
-    NodeAttributeValue,
-    NodeValue,
-    NodeEnd
-};
+    const auto peek = [&](std::string_view token){ return expression.substr(pos, token.size()) == token; };
 
-static bool readyNodeName(std::stack<XmlReaderType> & depth, XmlSAXReader * self, XmlBufferReader & buffer, std::string & error)
-{
-    int i = 0;
-    bool exit = false;
-    std::string name;
+    const auto name = [&]
+    {
+        const std::size_t begin = pos;
+        if(pos < expression.size() && isNameBegin(expression[pos])) while(++pos < expression.size() && isNameChar(expression[pos]));
+        return expression.substr(begin, pos - begin);
+    };
+
+    if(expression.empty())
+    {
+       _error = EmptyQueryMsg;
+       return false;
+    }
+
+    Axis axis = Child;
 
-    unsigned char ch;
+    if(peek("//"))
+    {
+       absolute = true;
+       axis = Descendant;
+       pos = 2;
+    }
+    else if(peek("/"))
+    {
+       absolute = true;
+       pos = 1;
+    }
 
-    while(buffer.next())
+    while(true)
     {
-          ch = buffer.value();
+          Step step{axis, std::string(), {}};
 
-          if(isControlCode(ch))
+          if(peek(".."))
           {
-             error =  makeError(ControlCharacterDetectionMsg, buffer);
-             return false;
+             step.axis = Parent;
+             pos += 2;
           }
-
-          if(std::isspace(ch) != 0)
+          else if(peek("."))
           {
-             if(i > 0)
-             {
-                self->NodeBegin(name);
-                depth.push(XmlReaderType::NodeBegin);
-                return true;
-             }
-             else
-             {
-                error = "";
-                return false;
-             }
+             step.axis = Self;
+             pos++;
           }
-
-          if(ch == '/')
+          else
           {
-             if(i > 0)
-             {
-                if(!buffer.next()) break;
-
-                if(buffer.value() != '>')
-                {
-                   error = "";
-                   return false;
-                }
+             const std::size_t begin = pos;
+             std::string_view test = name();
+             const std::size_t separator = test.find("::");
 
-                self->NodeBegin(name);
-                self->NodeEnd();
-                return true;
-             }
-             else
+             if(separator != std::string_view::npos)
              {
-                error = "";
-                return false;
+                const std::string_view axisName = test.substr(0, separator);
+                pos = begin;
+                if(axisName == "parent") step.axis = Parent;
+                else if(axisName == "self") step.axis = Self;
+                else if(axisName != "child") return fail(InvalidAxisMsg);
+
+                pos = begin + separator + 2;
+                test = name();
              }
-          }
 
-          if(ch == '>')
-          {
-             if(i > 0)
+             if(test.empty())
              {
-                self->NodeBegin(name);
-                depth.push(XmlReaderType::NodeValue);
-                return true;
+                if(!peek("*")) return fail(InvalidStepMsg);
+                pos++;
              }
-             else
+             else step.name = test;
+
+             while(peek("["))
              {
-                error = "";
-                return false;
+                   pos++;
+                   Predicate predicate{Predicate::Position, std::string(), std::string(), 0};
+
+                   if(peek("@"))
+                   {
+                      pos++;
+                      const std::string_view attributeName = name();
+                      if(attributeName.empty()) return fail(InvalidPredicateMsg);
+                      predicate.kind = Predicate::Attribute;
+                      predicate.name = attributeName;
+
+                      if(peek("="))
+                      {
+                         pos++;
+                         const char quote = (pos < expression.size()) ? expression[pos] : 0;
+                         if(quote != '\'' && quote != '"') return fail(InvalidPredicateMsg);
+                         const std::size_t end = expression.find(quote, pos + 1);
+                         if(end == std::string_view::npos) return fail(InvalidPredicateMsg);
+                         predicate.kind = Predicate::AttributeValue;
+                         predicate.value = expression.substr(pos + 1, end - pos - 1);
+                         pos = end + 1;
+                      }
+                   }
+                   else if(peek("last()"))
+                   {
+                      predicate.kind = Predicate::Last;
+                      pos += 6;
+                   }
+                   else
+                   {
+                      while(pos < expression.size() && expression[pos] >= '0' && expression[pos] <= '9')
+                      {
+                            predicate.position = predicate.position * 10 + static_cast<std::size_t>(expression[pos] - '0');
+                            pos++;
+                      }
+
+                      if(predicate.position == 0) return fail(InvalidPredicateMsg);
+                   }
+
+                   if(!peek("]")) return fail(InvalidPredicateMsg);
+                   pos++;
+                   step.predicates.push_back(std::move(predicate));
              }
           }
 
-          if((i == 0 && std::isalpha(ch) == 0) || (std::isalpha(ch) == 0 && ch != ':' && ch != '-' && ch != '_' && ch != '.'))
-          {
-             error = "";
-             return false;
-          }
-
-          name.push_back(ch);
+          //. and .. are not name tests, //. and //.. are left out
+          if(axis == Descendant && step.axis != Descendant) return fail(InvalidStepMsg);
 
-          i++;
-    }
+          steps.push_back(std::move(step));
+          if(pos == expression.size()) break;
 
-    if(!exit)
-    {
-       error = "";
-       return false;
+          if(peek("//"))
+          {
+             axis = Descendant;
+             pos += 2;
+          }
+          else if(peek("/"))
+          {
+             axis = Child;
+             pos++;
+          }
+          else return fail(UnexpectedQueryCharacterMsg);
     }
 
     return true;
 }
 
-//----------------------------------------------------------------
+bool XmlQuery::isValid() const { return !steps.empty(); }
 
-void XmlSAXReader::stopParse(){ stop = true; }
+std::string XmlQuery::error() const { return _error; }
 
-XmlSAXReader::XmlSAXReader(){}
-XmlSAXReader::~XmlSAXReader(){}
+std::vector<XmlNode> XmlQuery::select(const XmlIndex & index) const
+{
+    if(!index.isValid()) return std::vector<XmlNode>();
+    return select(index, std::vector<std::size_t>{absolute ? std::string::npos : 0});
+}
 
-std::string XmlSAXReader::error() const{ return std::move(_error); }
+std::vector<XmlNode> XmlQuery::select(const XmlIndex & index, const XmlNode & context) const
+{
+    if(absolute) return select(index);
 
-bool XmlSAXReader::parse(XmlBufferReader & buffer, Operation operation)
+    const std::size_t node = index.find(context);
+    if(node == std::string::npos) return std::vector<XmlNode>();
+    return select(index, std::vector<std::size_t>{node});
+}
+
+//The context holds preorder positions in the index, npos stands for the document above the root
+std::vector<XmlNode> XmlQuery::select(const XmlIndex & index, std::vector<std::size_t> && context) const
 {
-    stop = false;
-    std::stack<XmlReaderType> depth;
+    constexpr std::size_t Document = std::string::npos;
 
-    while(buffer.next())
+    const auto & nodes = index.nodes;
+    std::vector<std::size_t> next;
+    std::unordered_map<std::size_t, std::size_t> counts, seen;
+
+    for(const auto & step : steps)
     {
-        const unsigned char ch = buffer.value();
+        if(!isValid() || context.empty()) break;
 
-        if(std::isspace(ch) != 0) continue;
+        const auto match = [&](std::size_t node){ return step.name.empty() || nodes[node].node.nodeName() == step.name; };
+        next.clear();
 
-        if(isControlCode(ch))
+        for(std::size_t node : context)
         {
-           _error =  makeError(ControlCharacterDetectionMsg, buffer);
-           return false;
-        }
+            switch(step.axis)
+            {
+                case Child:
+                    if(node == Document)
+                    {
+                       if(match(0)) next.push_back(0);
+                    }
+                    else for(std::size_t child = node + 1; child < nodes[node].end; child = nodes[child].end){ if(match(child)) next.push_back(child); }
+                    break;
 
-        if(depth.empty())
-        {
-           if(ch == '<')
-           {
-              XmlBegin();
-              if(!readyNodeName(depth,this, buffer, this->_error)) return false;
-              continue;
-           }
-           else
-           {
-              _error =  makeError(InvalidEntryCharacterMsg, ch, buffer);
-              return false;
-           }
+                case Descendant:
+                {
+                    const std::size_t begin = (node == Document) ? 0 : node + 1,
+                                      end = (node == Document) ? nodes.size() : nodes[node].end;
+
+                    if(step.name.empty())
+                    {
+                       for(std::size_t child = begin; child < end; child++) next.push_back(child);
+                       break;
+                    }
+
+                    //Nodes of one name are in preorder, the subtree is a contiguous range of them
+                    auto iter = index.names.find(step.name);
+                    if(iter == index.names.end()) break;
+                    auto first = std::lower_bound(iter->second.begin(), iter->second.end(), begin);
+                    auto last = std::lower_bound(first, iter->second.end(), end);
+                    next.insert(next.end(), first, last);
+                    break;
+                }
+
+                case Parent:
+                    if(node != Document && nodes[node].parent != Document && match(nodes[node].parent)) next.push_back(nodes[node].parent);
+                    break;
+
+                case Self:
+                    if(node != Document && match(node)) next.push_back(node);
+                    break;
+            }
         }
-        else if(ch == '<')
+
+        if(context.size() > 1)
         {
-           if(depth.top() == XmlReaderType::NodeValue)
-           {
-              if(!readyNodeName(depth,this, buffer, this->_error)) return false;
-              continue;
-           }
-           else
-           {
-              _error = "";
-           }
+           std::sort(next.begin(), next.end());
+           next.erase(std::unique(next.begin(), next.end()), next.end());
         }
-        else if(ch == '>')
-        {
-           if(depth.top() == XmlReaderType::NodeBegin)
-           {
 
-           }
-           else
-           {
-              _error = "";
-           }
-        }
-        else if(ch == '/')
+        for(const auto & predicate : step.predicates)
         {
-           if(depth.top() == XmlReaderType::NodeBegin)
-           {
+            const auto group = [&](std::size_t node){ return (step.axis == Child || step.axis == Descendant) ? nodes[node].parent : node; };
 
-           }
-           else
-           {
-              _error = "";
-           }
-        }
-        else if(ch == '=')
-        {
-           if(depth.top() == XmlReaderType::NodeAttribute)
-           {
+            switch(predicate.kind)
+            {
+                case Predicate::Attribute:
+                    std::erase_if(next, [&](std::size_t node){ return !nodes[node].node.containsAttribute(predicate.name); });
+                    break;
 
-           }
-           else
-           {
-              _error = "";
-           }
-        }
-        else if(ch == '\'' || ch == '"')
-        {
-           if(depth.top() == XmlReaderType::NodeAttributeValue)
-           {
+                case Predicate::AttributeValue:
+                    std::erase_if(next, [&](std::size_t node)
+                    {
+                        const XmlNode::Attributes & attributes = nodes[node].node.attributes();
+                        auto iter = attributes.find(predicate.name);
+                        return iter == attributes.end() || iter->second != predicate.value;
+                    });
+                    break;
 
-           }
-           else
-           {
-              _error = "";
-           }
-        }
-        else
-        {
-           if(depth.top() == XmlReaderType::NodeBegin)
-           {
+                case Predicate::Position:
+                    seen.clear();
+                    std::erase_if(next, [&](std::size_t node){ return ++seen[group(node)] != predicate.position; });
+                    break;
 
-           }
-           else
-           {
-              _error = "";
-           }
+                case Predicate::Last:
+                    counts.clear();
+                    seen.clear();
+                    for(std::size_t node : next) counts[group(node)]++;
+                    std::erase_if(next, [&](std::size_t node){ const std::size_t key = group(node); return ++seen[key] != counts[key]; });
+                    break;
+            }
         }
 
-        ///next xml
+        context.swap(next);
     }
 
-    if(!depth.empty())
-    {
-       _error = "";
-       return false;
-    }
+    std::vector<XmlNode> ret;
+    if(!isValid()) return ret;
+    ret.reserve(context.size());
+    for(std::size_t node : context){ if(node != Document) ret.push_back(nodes[node].node); }
+    return ret;
+}
 
+//-----------------------------------------------------------
+
+bool XmlBufferWriter::write(std::string_view block)
+{
+    for(unsigned char ch : block){ if(!write(ch)) return false; }
     return true;
 }
 
-//-------------------------------------------------------------------------------------------
+//------------------
+
+XmlStringBufferWriter::XmlStringBufferWriter(){}
 
-XmlNode::XmlNode(){}
-XmlNode::XmlNode(const std::string & nodeName, bool sort)
+bool XmlStringBufferWriter::write(unsigned char ch)
 {
-    data->sort = sort;
-    data->name = nodeName;
+    count++;
+    XML_STATISTIC(_statistics.bytes++);
+    XML_STATISTIC(const std::size_t capacity = xml.capacity());
+    xml.push_back(ch);
+    XML_STATISTIC(if(xml.capacity() != capacity) _statistics.bufferAllocations++);
+    return true;
 }
 
-bool XmlNode::isValid() const { return !data->name.empty(); }
-XmlNode XmlNode::copy() const
+bool XmlStringBufferWriter::write(std::string_view block)
 {
-    XmlNode ret;
-    *ret.data = *data;
-    return ret;
+    count += block.size();
+    XML_STATISTIC(_statistics.bytes += block.size());
+    XML_STATISTIC(const std::size_t capacity = xml.capacity());
+    xml.append(block);
+    XML_STATISTIC(if(xml.capacity() != capacity) _statistics.bufferAllocations++);
+    return true;
 }
-std::size_t XmlNode::attributesCount() const { return data->attributes.size(); }
-XmlNode::Attributes & XmlNode::attributes(){ return data->attributes; }
-const XmlNode::Attributes & XmlNode::attributes() const { return data->attributes; }
-XmlNode::operator Attributes & (){ return data->attributes; }
-XmlNode::operator const Attributes & () const{ return data->attributes; }
-void XmlNode::setAttributes(const Attributes & attributes){ data->attributes = attributes; }
-bool XmlNode::containsAttribute(const std::string & attributeName) const{ return data->attributes.contains(attributeName); }
-std::string XmlNode::attributeValue(const std::string & attributeName) const { return (data->attributes.contains(attributeName)) ? data->attributes[attributeName] : std::string(); }
-void XmlNode::addAttribute(const std::string & attributeName, const std::string & value){ data->attributes[attributeName] = value; }
-void XmlNode::removeAttribute(const std::string & attributeName){ data->attributes.erase(attributeName); }
-void XmlNode::clearAttributes(){ data->attributes.clear(); }
-
-bool XmlNode::isValue() const { return !data->value.empty(); }
-const std::string & XmlNode::value() const { return data->value; }
-XmlNode::operator const std::string &() const { return data->value; }
-void XmlNode::setValue(const char * value)
+
+std::size_t XmlStringBufferWriter::writeCount(){ return count; }
+
+const std::string & XmlStringBufferWriter::result() const { return xml; }
+
+//------------------
+
+XmlFileBufferWriter::XmlFileBufferWriter(){}
+
+XmlFileBufferWriter::~XmlFileBufferWriter(){ flush(); }
+
+bool XmlFileBufferWriter::open(const std::string &fileName)
 {
-    data->childs.clear();
-    data->value = value;
+    flush();
+    count = 0;
+    if(stream.is_open()) stream.close();
+    stream.open(fileName);
+    is_open = stream.is_open();
+    return is_open;
 }
-void XmlNode::setValue(std::string_view value)
+
+bool XmlFileBufferWriter::isOpen(){ return is_open; }
+
+bool XmlFileBufferWriter::flush()
 {
-    data->childs.clear();
-    data->value = value;
+    if(!is_open) return false;
+    if(size == 0) return true;
+
+    XML_TRACE_SCOPE(XmlTrace::Flush, _statistics.ioTime);
+    stream.write(block.get(), static_cast<std::streamsize>(size));
+    XML_STATISTIC(_statistics.bytes += size);
+    size = 0;
+    stream.flush();
+    return stream.good();
 }
-void XmlNode::setValue(const std::string & value)
+
+bool XmlFileBufferWriter::write(unsigned char ch)
 {
-    data->childs.clear();
-    data->value = value;
+    if(!is_open) return false;
+
+    if(!block)
+    {
+       block = std::make_unique<char[]>(BlockSize);
+       XML_STATISTIC(_statistics.bufferAllocations++);
+    }
+    else if(size == BlockSize && !flush()) return false;
+
+    block[size++] = static_cast<char>(ch);
+    count++;
+    return true;
 }
-bool XmlNode::isChilds() const { return !data->childs.empty(); }
-std::size_t XmlNode::childsCount() const { return data->childs.size(); }
-const XmlNode::Childs & XmlNode::childs() const { return data->childs; }
-XmlNode::operator const Childs & () const { return data->childs; }
-void XmlNode::setChilds(const Childs & childs)
+
+bool XmlFileBufferWriter::write(std::string_view block)
 {
-    data->value.clear();
-    data->childs = childs;
-    if(data->sort) data->childs.sort();
+    if(!is_open) return false;
+
+    if(!this->block)
+    {
+       this->block = std::make_unique<char[]>(BlockSize);
+       XML_STATISTIC(_statistics.bufferAllocations++);
+    }
+
+    while(!block.empty())
+    {
+          if(size == BlockSize && !flush()) return false;
+
+          const std::size_t length = std::min(block.size(), BlockSize - size);
+          std::memcpy(this->block.get() + size, block.data(), length);
+          size += length;
+          count += length;
+          block.remove_prefix(length);
+    }
+
+    return true;
 }
-bool XmlNode::containsChild(const std::string & nodeName) const
+
+std::size_t XmlFileBufferWriter::writeCount(){ return count; };
+
+//------------------
+
+XmlCompressBufferWriter::XmlCompressBufferWriter(){}
+
+void XmlCompressBufferWriter::reset()
 {
-    for(const auto & child : data->childs){ if(child.data->name == nodeName) return true; }
-    return false;
+    count = 0;
+    size = 0;
+    _error.clear();
 }
-std::vector<XmlNode> XmlNode::child(const std::string & nodeName) const
+
+std::string XmlCompressBufferWriter::error() const { return _error; }
+
+bool XmlCompressBufferWriter::isOpen(){ return is_open; }
+
+bool XmlCompressBufferWriter::close()
 {
-    std::vector<XmlNode> ret;
-    for(const auto & child : data->childs){ if(child.data->name == nodeName) ret.push_back(child); }
+    if(!is_open) return false;
+
+    XML_TRACE_SCOPE(XmlTrace::Flush, _statistics.ioTime);
+    const bool ret = compress(block.get(), size, true);
+    XML_STATISTIC(_statistics.bytes += size);
+    size = 0;
+    is_open = false;
     return ret;
 }
-bool XmlNode::addChild(const XmlNode & node)
+
+bool XmlCompressBufferWriter::write(unsigned char ch){ return write(std::string_view(reinterpret_cast<const char *>(&ch), 1)); }
+
+bool XmlCompressBufferWriter::write(std::string_view block)
 {
-    if(!node.isValid()) return false;
-    data->value.clear();
-    data->childs.push_back(node);
-    if(data->sort) data->childs.sort();
+    if(!is_open) return false;
+
+    if(!this->block)
+    {
+       this->block = std::make_unique<char[]>(BlockSize);
+       XML_STATISTIC(_statistics.bufferAllocations++);
+    }
+
+    while(!block.empty())
+    {
+          if(size == BlockSize)
+          {
+             XML_TRACE_SCOPE(XmlTrace::Flush, _statistics.ioTime);
+             if(!compress(this->block.get(), size, false)) return false;
+             XML_STATISTIC(_statistics.bytes += size);
+             size = 0;
+          }
+
+          const std::size_t length = std::min(block.size(), BlockSize - size);
+          std::memcpy(this->block.get() + size, block.data(), length);
+          size += length;
+          count += length;
+          block.remove_prefix(length);
+    }
+
     return true;
 }
-void XmlNode::removeChild(const std::string & nodeName)
+
+std::size_t XmlCompressBufferWriter::writeCount(){ return count; }
+
+#ifdef XML_ZLIB
+
+struct XmlGzipBufferWriter::Stream
+{
+    std::ofstream file;
+    z_stream z{};
+    bool initialized = false;
+    std::unique_ptr<unsigned char[]> output = std::make_unique<unsigned char[]>(CompressedInputSize);
+
+    ~Stream(){ if(initialized) deflateEnd(&z); }
+};
+
+XmlGzipBufferWriter::XmlGzipBufferWriter(){}
+
+XmlGzipBufferWriter::~XmlGzipBufferWriter(){ close(); }
+
+bool XmlGzipBufferWriter::open(const std::string & fileName, int level)
+{
+    close();
+    reset();
+    stream = std::make_unique<Stream>();
+    stream->file.open(fileName, std::ios::binary);
+
+    //15 + 16 writes a gzip header instead of a zlib one
+    is_open = stream->file.is_open() && deflateInit2(&stream->z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    stream->initialized = is_open;
+    return is_open;
+}
+
+bool XmlGzipBufferWriter::compress(const char * data, std::size_t size, bool finish)
 {
-    std::size_t count = 0;
-    for(auto begin = data->childs.begin(); begin != data->childs.end(); begin++)
+    Stream & s = *stream;
+    s.z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    s.z.avail_in = static_cast<uInt>(size);
+
+    int ret;
+
+    do
     {
-        if(begin->data->name == nodeName)
+        s.z.next_out = s.output.get();
+        s.z.avail_out = static_cast<uInt>(CompressedInputSize);
+        ret = deflate(&s.z, finish ? Z_FINISH : Z_NO_FLUSH);
+
+        if(ret == Z_STREAM_ERROR)
         {
-           begin = data->childs.erase(begin);
-           count++;
+           _error = "Invalid gzip stream";
+           return false;
         }
+
+        s.file.write(reinterpret_cast<const char *>(s.output.get()), static_cast<std::streamsize>(CompressedInputSize - s.z.avail_out));
     }
+    while(s.z.avail_out == 0 || (finish && ret != Z_STREAM_END));
 
-    if(count > 0 && data->sort) data->childs.sort();
-}
+    if(!s.file.good())
+    {
+       _error = "Write error";
+       return false;
+    }
 
-bool XmlNode::operator<(const XmlNode & other) const{ return (data->name < other.data->name); }
+    if(finish) s.file.close();
+    return true;
+}
 
-//-----------------------------------------------------------
+#endif
 
-XmlStringBufferWriter::XmlStringBufferWriter(){}
+#ifdef XML_ZSTD
 
-bool XmlStringBufferWriter::write(unsigned char ch)
+struct XmlZstdBufferWriter::Stream
 {
-    count++;
-    xml.push_back(ch);
-    return true;
-}
-
-std::size_t XmlStringBufferWriter::writeCount(){ return count; }
+    std::ofstream file;
+    ZSTD_CCtx * context = ZSTD_createCCtx();
+    std::unique_ptr<char[]> output = std::make_unique<char[]>(CompressedInputSize);
 
-const std::string & XmlStringBufferWriter::result() const { return xml; }
+    ~Stream(){ ZSTD_freeCCtx(context); }
+};
 
-//------------------
+XmlZstdBufferWriter::XmlZstdBufferWriter(){}
 
-XmlFileBufferWriter::XmlFileBufferWriter(){}
+XmlZstdBufferWriter::~XmlZstdBufferWriter(){ close(); }
 
-bool XmlFileBufferWriter::open(const std::string &fileName)
+bool XmlZstdBufferWriter::open(const std::string & fileName, int level)
 {
-    count = 0;
-    if(stream.is_open()) stream.close();
-    stream.open(fileName);
-    is_open = stream.is_open();
+    close();
+    reset();
+    stream = std::make_unique<Stream>();
+    stream->file.open(fileName, std::ios::binary);
+    is_open = stream->file.is_open() && stream->context != nullptr &&
+              !ZSTD_isError(ZSTD_CCtx_setParameter(stream->context, ZSTD_c_compressionLevel, level));
     return is_open;
 }
 
-bool XmlFileBufferWriter::isOpen(){ return is_open; }
-
-bool XmlFileBufferWriter::write(unsigned char ch)
+bool XmlZstdBufferWriter::compress(const char * data, std::size_t size, bool finish)
 {
-    if(!is_open) return false;
-    stream << ch;
-    count++;
+    Stream & s = *stream;
+    ZSTD_inBuffer in{data, size, 0};
+    bool done;
+
+    do
+    {
+        ZSTD_outBuffer out{s.output.get(), CompressedInputSize, 0};
+        const std::size_t ret = ZSTD_compressStream2(s.context, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+
+        if(ZSTD_isError(ret))
+        {
+           _error = ZSTD_getErrorName(ret);
+           return false;
+        }
+
+        s.file.write(s.output.get(), static_cast<std::streamsize>(out.pos));
+        done = finish ? (ret == 0) : (in.pos == in.size);
+    }
+    while(!done);
+
+    if(!s.file.good())
+    {
+       _error = "Write error";
+       return false;
+    }
+
+    if(finish) s.file.close();
     return true;
 }
 
-std::size_t XmlFileBufferWriter::writeCount(){ return count; };
+#endif
 
 //-----------------------------------------------------------
 
@@ -423,6 +2721,7 @@ static const char * const InvalidBuffer = "Invalid buffer",
                   * const InvalidOperation = "Invalid operation",
                   * const InvalidName = "Invalid name",
                   * const ControlCharacterDetect = "Control character detection",
+                  * const InvalidSequence = "Invalid UTF-8 sequence",
                   * const BufferEnding = "Buffer ending";
 
 bool XmlSAXWriter::checkBuffer()
@@ -436,20 +2735,25 @@ bool XmlSAXWriter::checkBuffer()
     return true;
 }
 
-bool XmlSAXWriter::writeChar(unsigned char ch)
+bool XmlSAXWriter::validate(std::string_view string)
 {
-    if(isControlCode(ch))
-    {
-       _error = ControlCharacterDetect;
-       return false;
-    }
+    std::size_t offset;
+    const Utf8Status status = validateUtf8(string.data(), string.size(), offset);
+    if(status == Utf8Status::Valid) return true;
+
+    _error = std::string((status == Utf8Status::ControlCharacter) ? ControlCharacterDetect : InvalidSequence) + ", offset: " + std::to_string(offset);
+    return false;
+}
 
+bool XmlSAXWriter::writeChar(unsigned char ch)
+{
     if(!buffer->write(ch))
     {
        _error = BufferEnding;
        return false;
     }
 
+    XML_STATISTIC(_statistics.bytes++);
     return true;
 }
 
@@ -459,7 +2763,7 @@ bool XmlSAXWriter::writeSpace(int count)
     return true;
 }
 
-bool XmlSAXWriter::writeName(const std::string & name)
+bool XmlSAXWriter::writeName(std::string_view name)
 {
     int i = 0;
 
@@ -488,41 +2792,56 @@ bool XmlSAXWriter::writeName(const std::string & name)
            _error = InvalidName;
         }
 
-        if(!writeChar(c)) return false;
         i++;
     }
 
-    return true;
+    return validate(name) && writeString(name);
 }
 
 bool XmlSAXWriter::writeString(std::string_view string)
 {
-    for(unsigned char c : string){ if(!writeChar(c)) return false; }
+    if(!buffer->write(string))
+    {
+       _error = BufferEnding;
+       return false;
+    }
+
+    XML_STATISTIC(_statistics.bytes += string.size());
     return true;
 }
 
-bool XmlSAXWriter::writeValue(const std::string & value, bool isAttrebute)
+bool XmlSAXWriter::writeValue(std::string_view value, bool isAttrebute)
 {
+    if(!validate(value)) return false;
     if(isAttrebute && !writeChar('"')) return false;
 
-    for(unsigned char c : value)
+    const char * begin = value.data(), * const end = begin + value.size();
+
+    for(const char * iter = begin; iter != end; iter++)
     {
-        switch (c)
+        const char * entity;
+
+        switch (*iter)
         {
-           case '<': if(!writeString("&lt;")) return false;
+           case '<': entity = "&lt;";
            break;
-           case '>': if(!writeString("&gt;")) return false;
+           case '>': entity = "&gt;";
            break;
-           case '&': if(!writeString("&amp;")) return false;
+           case '&': entity = "&amp;";
            break;
-           case '"': if(!writeString("&quot;")) return false;
+           case '"': entity = "&quot;";
            break;
-           case '\'': if(!writeString("&apos;")) return false;
+           case '\'': entity = "&apos;";
            break;
-           default: if(!writeChar(c)) return false;
+           default: continue;
         }
+
+        if(!writeString(std::string_view(begin, static_cast<std::size_t>(iter - begin))) || !writeString(entity)) return false;
+        XML_STATISTIC(_statistics.entities++);
+        begin = iter + 1;
     }
 
+    if(begin != end && !writeString(std::string_view(begin, static_cast<std::size_t>(end - begin)))) return false;
     if(isAttrebute && !writeChar('"')) return false;
     return true;
 }
@@ -531,40 +2850,59 @@ XmlSAXWriter::XmlSAXWriter(){}
 
 std::string XmlSAXWriter::error() const { return std::move(_error); }
 
+const XmlStatistics & XmlSAXWriter::statistics() const { return _statistics; }
+
 void XmlSAXWriter::setBuffer(XmlBufferWriter * buffer, bool beautiful)
 {
     while(!stack.empty()) stack.pop();
+    _statistics.clear();
     this->buffer = buffer;
     this->beautiful = beautiful;
 }
 
-bool XmlSAXWriter::NodeBegin(const std::string & name)
+void XmlSAXWriter::switchBuffer(XmlBufferWriter * buffer)
 {
-    if(!stack.empty())
-    {
-       if(std::get<0>(stack.top()) == Сondition::NodeValue || std::get<0>(stack.top()) == Сondition::NodeAttribute)
-       {
-          _error = InvalidOperation;
-          return false;
-       }
+    this->buffer = buffer;
+}
 
-       if(std::get<0>(stack.top()) == Сondition::NodeBegin)
-       { 
-          if(!writeChar('>') || (beautiful && !writeChar('\n'))) return false;
-          std::get<0>(stack.top()) = Сondition::NodeChilds;
-       }
+bool XmlSAXWriter::beginChild()
+{
+    if(stack.empty()) return true;
+
+    if(std::get<0>(stack.top()) == Сondition::NodeValue || std::get<0>(stack.top()) == Сondition::NodeAttribute)
+    {
+       _error = InvalidOperation;
+       return false;
+    }
 
-       if(beautiful){ if(!writeSpace(4 * stack.size())) return false; }
+    if(std::get<0>(stack.top()) == Сondition::NodeBegin)
+    { 
+       if(!writeChar('>') || (beautiful && !writeChar('\n'))) return false;
+       std::get<0>(stack.top()) = Сondition::NodeChilds;
     }
 
+    return true;
+}
+bool XmlSAXWriter::writeFragment(std::string_view fragment)
+{
+    if(!checkBuffer() || !beginChild() || !writeString(fragment)) return false;
+    if(!stack.empty()) std::get<0>(stack.top()) = Сondition::NodeEnd;
+    return true;
+}
+bool XmlSAXWriter::NodeBegin(std::string_view name)
+{
+    if(!beginChild()) return false;
+    if(beautiful && !stack.empty() && !writeSpace(4 * stack.size())) return false;
+
     if(!writeChar('<') || !writeName(name)) return false;
-    stack.push({Сondition::NodeBegin, std::string(), std::set<std::string>()});
-    std::get<1>(stack.top()) = name;
+    stack.push({Сondition::NodeBegin, std::string(name), std::set<std::string, std::less<>>()});
+    XML_STATISTIC(_statistics.elements++);
+    XML_STATISTIC(_statistics.maxDepth = std::max(_statistics.maxDepth, stack.size()));
 
     return true;
 }
 
-bool XmlSAXWriter::AttributeName(const std::string & name)
+bool XmlSAXWriter::AttributeName(std::string_view name)
 {
     if(stack.empty() || std::get<0>(stack.top()) != Сondition::NodeBegin || std::get<2>(stack.top()).contains(name))
     {
@@ -573,12 +2911,13 @@ bool XmlSAXWriter::AttributeName(const std::string & name)
     }
 
     if(!writeChar(' ') || !writeName(name)) return false;
-    std::get<2>(stack.top()).insert(name);
+    std::get<2>(stack.top()).emplace(name);
     std::get<0>(stack.top()) = Сondition::NodeAttribute;
+    XML_STATISTIC(_statistics.attributes++);
     return true;
 }
 
-bool XmlSAXWriter::AttributeValue(const std::string & value)
+bool XmlSAXWriter::AttributeValue(std::string_view value)
 {
     if(stack.empty() || (std::get<0>(stack.top()) != Сondition::NodeAttribute))
     {
@@ -591,7 +2930,7 @@ bool XmlSAXWriter::AttributeValue(const std::string & value)
     return true;
 }
 
-bool XmlSAXWriter::Value(const std::string & value)
+bool XmlSAXWriter::Value(std::string_view value)
 {
     if(stack.empty() || (std::get<0>(stack.top()) != Сondition::NodeBegin))
     {
@@ -635,10 +2974,83 @@ XmlWriter::XmlWriter(){}
 
 bool XmlWriter::write(XmlBufferWriter & buffer, const XmlNode & node, bool beautiful)
 {
-    if(node.data->name.empty()) return false;
-    using ChildIter = XmlNode::Childs::iterator;
+#ifdef XML_STATISTICS
+    const std::chrono::nanoseconds ioTime = buffer.statistics().ioTime;
+    std::chrono::nanoseconds writeTime{0};
+    bool ret;
+
+    {
+        XML_TRACE_SCOPE(XmlTrace::Write, writeTime);
+        ret = (caching) ? writeCached(buffer, node, beautiful) : writeNode(buffer, node, beautiful);
+    }
+
+    _statistics.writeTime = writeTime;
+    _statistics.ioTime = buffer.statistics().ioTime - ioTime;
+    return ret;
+#else
+    return (caching) ? writeCached(buffer, node, beautiful) : writeNode(buffer, node, beautiful);
+#endif
+}
+
+void XmlWriter::setCaching(bool caching){ this->caching = caching; }
+bool XmlWriter::isCaching() const { return caching; }
+
+XmlWriter::Level XmlWriter::level(XmlNode::XmlData * data, bool owned, const XmlNode::Childs * handles)
+{
+    return {data, false, owned, data->childs.cbegin(), handles, (handles) ? handles->cbegin() : XmlNode::Childs::const_iterator(), 0};
+}
+
+//Another tree holding a content can read it on another thread, so fragments are kept only in contents the tree holds alone:
+//the root by its cell, any other by the childs of its parent and by its handle if the parent made them.
+XmlWriter::Level XmlWriter::root(const XmlNode & node)
+{
+    bool owned = true;
+
+    for(std::shared_ptr<XmlNode::XmlCell> cell = node.cell; cell && owned;)
+    {
+        std::shared_ptr<XmlNode::XmlCell> parent = cell->parent.lock();
+        owned = (cell->data.use_count() == ((parent) ? 2 : 1));
+        cell = std::move(parent);
+    }
+
+    return level(node.cell->data.get(), owned, (owned) ? node.cell->childs.load(std::memory_order_acquire) : nullptr);
+}
+
+XmlWriter::Level XmlWriter::next(Level & level)
+{
+    const std::shared_ptr<XmlNode::XmlData> & data = *level.iter++;
+    const XmlNode * const handle = (level.handles) ? &*level.handle++ : nullptr;
+    const bool owned = (level.owned && data.use_count() == ((handle) ? 2 : 1));
+    return XmlWriter::level(data.get(), owned, (owned && handle) ? handle->cell->childs.load(std::memory_order_acquire) : nullptr);
+}
+
+void XmlWriter::clearCache(const XmlNode & node)
+{
+    std::vector<Level> stack{root(node)};
+    if(stack.back().owned) stack.back().data->fragment.clear();
+
+    while(!stack.empty())
+    {
+          Level & level = stack.back();
+
+          if(!level.owned || level.iter == level.data->childs.cend())
+          {
+             stack.pop_back();
+             continue;
+          }
+
+          Level child = next(level);
+          if(child.owned) child.data->fragment.clear();
+          stack.push_back(child);
+    }
+}
+
+bool XmlWriter::writeNode(XmlBufferWriter & buffer, const XmlNode & node, bool beautiful)
+{
+    if(node.cell->data->name.empty()) return false;
+    using ChildIter = XmlNode::Contents::iterator;
     std::list<std::tuple<XmlNode::XmlData *, bool, ChildIter>> stack;
-    stack.push_back({node.data.get(), false, node.data->childs.begin()});
+    stack.push_back({node.cell->data.get(), false, node.cell->data->childs.begin()});
     setBuffer(&buffer, beautiful);
 
     while(!stack.empty())
@@ -667,26 +3079,100 @@ bool XmlWriter::write(XmlBufferWriter & buffer, const XmlNode & node, bool beaut
           if(std::get<2>(stack.back()) != std::get<0>(stack.back())->childs.end())
           {
              ChildIter iter = std::get<2>(stack.back())++;
-             int count = 0;
+             stack.push_back({iter->get(), false, (*iter)->childs.begin()});
+             continue;
+          }
+
+          if(!NodeEnd()) return false;
+          stack.pop_back();
+    }
 
-             for(const auto & tuple : stack)
+    return true;
+}
+
+bool XmlWriter::writeCached(XmlBufferWriter & buffer, const XmlNode & node, bool beautiful)
+{
+    if(node.cell->data->name.empty()) return false;
+
+    const auto cached = [beautiful](const XmlNode::XmlData * data, std::size_t depth)
+    {
+        const XmlNode::XmlFragment & fragment = data->fragment;
+        return fragment.valid && fragment.beautiful == beautiful && (fragment.depth == depth || !beautiful);
+    };
+
+    std::vector<Level> stack{root(node)};
+    setBuffer(&buffer, beautiful);
+    if(cached(stack.back().data, 0)) return writeFragment(stack.back().data->fragment.bytes);
+
+    //Changed subtrees are serialized into scratch, their output is the range from their offset on
+    XmlStringBufferWriter scratch;
+    const std::string & output = scratch.result();
+    switchBuffer(&scratch);
+
+    const auto end = [&]
+    {
+        if(!NodeEnd()) return false;
+
+        if(stack.back().owned)
+        {
+           XmlNode::XmlFragment & fragment = stack.back().data->fragment;
+           fragment.bytes.assign(output, stack.back().offset);
+           fragment.depth = stack.size() - 1;
+           fragment.beautiful = beautiful;
+           fragment.valid = true;
+        }
+
+        stack.pop_back();
+        return true;
+    };
+
+    while(!stack.empty())
+    {
+          Level & level = stack.back();
+
+          if(!level.entered)
+          {
+             if(!NodeBegin(level.data->name)) return false;
+
+             for(const auto & pair : level.data->attributes)
              {
-                 if(std::get<0>(tuple) == iter->data.get())
-                 {
-                    count++;
-                    break;
-                 }
+                 if(!AttributeName(pair.first)) return false;
+                 if(!AttributeValue(pair.second)) return false;
              }
 
-             if(count == 0) stack.push_back({iter->data.get(), false, iter->data->childs.begin()});
+             if(!level.data->value.empty())
+             {
+                if(!Value(level.data->value) || !end()) return false;
+                continue;
+             }
+
+             level.entered = true;
+          }
+
+          if(level.iter == level.data->childs.cend())
+          {
+             if(!end()) return false;
              continue;
           }
 
-          if(!NodeEnd()) return false;
-          stack.pop_back();
+          //Fragments of shared contents are read as well, nobody writes them while they are shared
+          Level child = next(level);
+
+          if(cached(child.data, stack.size()))
+          {
+             if(!writeFragment(child.data->fragment.bytes)) return false;
+             continue;
+          }
+
+          if(!beginChild()) return false;
+          child.offset = output.size();
+          stack.push_back(child);
     }
 
-    return true;
+    //The scratch bytes are counted once more when they are copied
+    switchBuffer(&buffer);
+    XML_STATISTIC(_statistics.bytes -= output.size());
+    return writeFragment(output);
 }
 
 bool XmlWriter::write(std::string & string, const XmlNode & node, bool beautiful)
@@ -707,6 +3193,394 @@ std::string XmlWriter::write(const XmlNode & node, bool beautiful)
 bool XmlWriter::writeToFile(const std::string & fileName, const XmlNode &node, bool beautiful)
 {
     XmlFileBufferWriter buffer;
-    if(!buffer.open(fileName) || !write(buffer, node, beautiful)) return false;
+    if(!buffer.open(fileName) || !write(buffer, node, beautiful) || !buffer.flush()) return false;
     return true;
 }
+
+//-----------------------------------------------------------
+
+class XmlBatchReader::Pool final
+{
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::size_t> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Queue[]> queues;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::size_t generation = 0, running = 0;
+    bool exit = false;
+    const std::function<void(std::size_t worker, std::size_t index)> * task = nullptr;
+    std::exception_ptr failure;
+
+    //Own tasks are taken from the front, tasks of other workers are stolen from the back
+    bool pop(std::size_t worker, std::size_t & index)
+    {
+        for(std::size_t i = 0; i < workers.size(); i++)
+        {
+            Queue & queue = queues[(worker + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.tasks.empty()) continue;
+
+            if(i == 0)
+            {
+               index = queue.tasks.front();
+               queue.tasks.pop_front();
+            }
+            else
+            {
+               index = queue.tasks.back();
+               queue.tasks.pop_back();
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void work(std::size_t worker)
+    {
+        std::size_t seen = 0;
+
+        while(true)
+        {
+              {
+                  std::unique_lock<std::mutex> lock(mutex);
+                  wake.wait(lock, [&]{ return exit || generation != seen; });
+                  if(exit) return;
+                  seen = generation;
+              }
+
+              std::size_t index;
+              while(pop(worker, index)) (*task)(worker, index);
+
+              std::lock_guard<std::mutex> lock(mutex);
+              if(--running == 0) idle.notify_all();
+        }
+    }
+
+public:
+    std::vector<XmlReader> readers;
+    std::vector<XmlFileBufferReader> files;
+
+    explicit Pool(std::size_t count):queues(std::make_unique<Queue[]>(count)), readers(count), files(count)
+    {
+        workers.reserve(count);
+        for(std::size_t i = 0; i < count; i++) workers.emplace_back(&Pool::work, this, i);
+    }
+
+    ~Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exit = true;
+        }
+
+        wake.notify_all();
+        for(auto & worker : workers) worker.join();
+    }
+
+    std::size_t size() const { return workers.size(); }
+
+    //Hands out contiguous ranges of indexes to the workers and returns at once
+    void start(std::size_t count, const std::function<void(std::size_t worker, std::size_t index)> & task)
+    {
+        const std::size_t chunk = (count + workers.size() - 1) / workers.size();
+
+        for(std::size_t i = 0; i < workers.size(); i++)
+        {
+            std::lock_guard<std::mutex> lock(queues[i].mutex);
+            for(std::size_t index = i * chunk; index < std::min(count, (i + 1) * chunk); index++) queues[i].tasks.push_back(index);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->task = &task;
+            failure = nullptr;
+            running = workers.size();
+            generation++;
+        }
+
+        wake.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&]{ return running == 0; });
+    }
+
+    //Called from a catch block on a worker, the first exception is kept for the calling thread
+    void fail()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!failure) failure = std::current_exception();
+    }
+
+    void rethrow()
+    {
+        std::exception_ptr exception;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exception = std::move(failure);
+            failure = nullptr;
+        }
+
+        if(exception) std::rethrow_exception(exception);
+    }
+
+    //Parses count documents into nodes and delivers them on the calling thread
+    void read(std::size_t count, const std::function<bool(XmlReader & reader, std::size_t worker, std::size_t index, XmlNode & node)> & read,
+              const Callback & callback, Delivery delivery);
+
+    //Runs a reader made by factory on every worker over count documents
+    void parse(std::size_t count, const std::function<bool(XmlSAXReader & reader, std::size_t worker, std::size_t index)> & parse,
+               const ReaderFactory & factory, const Done & done);
+};
+
+XmlBatchReader::XmlBatchReader(std::size_t threads)
+{
+    if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    pool = std::make_unique<Pool>(threads);
+}
+
+XmlBatchReader::~XmlBatchReader(){}
+
+std::size_t XmlBatchReader::threads() const { return pool->size(); }
+
+void XmlBatchReader::readFiles(const std::vector<std::string> & fileNames, const Callback & callback, Delivery delivery)
+{
+    pool->read(fileNames.size(), [&](XmlReader & reader, std::size_t worker, std::size_t index, XmlNode & node)
+    {
+        XmlFileBufferReader & buffer = pool->files[worker];
+        if(buffer.open(fileNames[index])) return reader.read(buffer, node);
+        reader._error = CannotOpenFileMsg + fileNames[index];
+        return false;
+    }, callback, delivery);
+}
+
+void XmlBatchReader::readBuffers(const std::vector<std::string_view> & buffers, const Callback & callback, Delivery delivery)
+{
+    pool->read(buffers.size(), [&](XmlReader & reader, std::size_t, std::size_t index, XmlNode & node)
+    {
+        return reader.read(buffers[index], node);
+    }, callback, delivery);
+}
+
+std::size_t XmlBatchReader::readStream(std::string_view xml, const Callback & callback, Delivery delivery)
+{
+    const std::vector<std::string_view> documents = split(xml);
+    readBuffers(documents, callback, delivery);
+    return documents.size();
+}
+
+void XmlBatchReader::Pool::read(std::size_t count, const std::function<bool(XmlReader & reader, std::size_t worker, std::size_t index, XmlNode & node)> & read,
+                                const Callback & callback, Delivery delivery)
+{
+    if(count == 0) return;
+
+    std::vector<Document> documents(count);
+    //An exception is kept with its document and thrown when that document is due
+    std::vector<std::exception_ptr> failures(count);
+    std::deque<std::size_t> completed;
+    std::mutex mutex;
+    std::condition_variable ready;
+
+    const std::function<void(std::size_t worker, std::size_t index)> task = [&](std::size_t worker, std::size_t index)
+    {
+        XmlReader & reader = readers[worker];
+        Document & document = documents[index];
+        document.index = index;
+
+        try
+        {
+            document.success = read(reader, worker, index, document.node);
+            if(!document.success) document.error = reader.error();
+        }
+        catch(...){ failures[index] = std::current_exception(); }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        completed.push_back(index);
+        ready.notify_one();
+    };
+
+    const auto deliver = [&](std::size_t index)
+    {
+        if(failures[index]) std::rethrow_exception(failures[index]);
+        callback(documents[index]);
+        documents[index] = Document();
+    };
+
+    start(count, task);
+
+    try
+    {
+        std::vector<bool> done(count, false);
+        std::size_t next = 0, delivered = 0;
+
+        while(delivered < count)
+        {
+              std::size_t index;
+
+              {
+                  std::unique_lock<std::mutex> lock(mutex);
+                  ready.wait(lock, [&]{ return !completed.empty(); });
+                  index = completed.front();
+                  completed.pop_front();
+              }
+
+              delivered++;
+
+              if(delivery == Completed)
+              {
+                 deliver(index);
+                 continue;
+              }
+
+              done[index] = true;
+              for(; next < count && done[next]; next++) deliver(next);
+        }
+    }
+    catch(...)
+    {
+        wait();
+        throw;
+    }
+
+    wait();
+}
+
+void XmlBatchReader::Pool::parse(std::size_t count, const std::function<bool(XmlSAXReader & reader, std::size_t worker, std::size_t index)> & parse,
+                                 const ReaderFactory & factory, const Done & done)
+{
+    if(count == 0) return;
+
+    std::vector<std::unique_ptr<XmlSAXReader>> parsers(size());
+    for(auto & parser : parsers) parser = factory();
+
+    const std::function<void(std::size_t worker, std::size_t index)> task = [&](std::size_t worker, std::size_t index)
+    {
+        XmlSAXReader & reader = *parsers[worker];
+
+        try
+        {
+            done(index, reader, parse(reader, worker, index));
+        }
+        catch(...){ fail(); }
+    };
+
+    start(count, task);
+    wait();
+    rethrow();
+}
+
+void XmlBatchReader::parseFiles(const std::vector<std::string> & fileNames, const ReaderFactory & factory, const Done & done)
+{
+    pool->parse(fileNames.size(), [&](XmlSAXReader & reader, std::size_t worker, std::size_t index)
+    {
+        XmlFileBufferReader & buffer = pool->files[worker];
+        if(buffer.open(fileNames[index])) return reader.parse(buffer, XmlSAXReader::Single);
+        reader._error = CannotOpenFileMsg + fileNames[index];
+        return false;
+    }, factory, done);
+}
+
+void XmlBatchReader::parseBuffers(const std::vector<std::string_view> & buffers, const ReaderFactory & factory, const Done & done)
+{
+    pool->parse(buffers.size(), [&](XmlSAXReader & reader, std::size_t, std::size_t index)
+    {
+        XmlStringViewBufferReader buffer(buffers[index]);
+        return reader.parse(buffer, XmlSAXReader::Single);
+    }, factory, done);
+}
+
+std::size_t XmlBatchReader::parseStream(std::string_view xml, const ReaderFactory & factory, const Done & done)
+{
+    const std::vector<std::string_view> documents = split(xml);
+    parseBuffers(documents, factory, done);
+    return documents.size();
+}
+
+std::vector<std::string_view> XmlBatchReader::split(std::string_view xml)
+{
+    std::vector<std::string_view> ret;
+    std::size_t pos = 0, begin = std::string_view::npos;
+    long long depth = 0;
+    bool root = false;
+
+    const auto skip = [&](std::string_view terminator)
+    {
+        const std::size_t end = xml.find(terminator, pos);
+        pos = (end == std::string_view::npos) ? xml.size() : end + terminator.size();
+    };
+
+    while(pos < xml.size())
+    {
+          if(depth == 0)
+          {
+             if(std::isspace(static_cast<unsigned char>(xml[pos])) != 0)
+             {
+                pos++;
+                continue;
+             }
+
+             if(begin == std::string_view::npos) begin = pos;
+          }
+          else if((pos = xml.find('<', pos)) == std::string_view::npos) break;
+
+          if(xml[pos] != '<')
+          {
+             pos++;
+             continue;
+          }
+
+          if(xml.compare(pos, 4, "<!--") == 0){ skip("-->"); continue; }
+          if(xml.compare(pos, 9, "<![CDATA[") == 0){ skip("]]>"); continue; }
+          if(xml.compare(pos, 2, "<?") == 0){ skip("?>"); continue; }
+
+          const bool markup = (xml.compare(pos, 2, "<!") == 0), end = (xml.compare(pos, 2, "</") == 0);
+          int brackets = 0;
+          char quote = 0;
+
+          for(pos++; pos < xml.size(); pos++)
+          {
+              const char ch = xml[pos];
+
+              if(quote != 0){ if(ch == quote) quote = 0; }
+              else if(ch == '"' || ch == '\'') quote = ch;
+              else if(markup && ch == '[') brackets++;
+              else if(markup && ch == ']') brackets--;
+              else if(ch == '>' && brackets <= 0) break;
+          }
+
+          if(pos == xml.size()) break;
+          pos++;
+
+          if(markup) continue;
+
+          root = true;
+          if(end) depth--;
+          else if(xml[pos - 2] != '/') depth++;
+
+          if(depth <= 0)
+          {
+             ret.push_back(xml.substr(begin, pos - begin));
+             begin = std::string_view::npos;
+             depth = 0;
+             root = false;
+          }
+    }
+
+    if(begin != std::string_view::npos)
+    {
+       if(root || ret.empty()) ret.push_back(xml.substr(begin));
+       else ret.back() = std::string_view(ret.back().data(), static_cast<std::size_t>(xml.data() + xml.size() - ret.back().data()));
+    }
+
+    return ret;
+}
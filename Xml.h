@@ -2,24 +2,89 @@
 #define XML_H
 
 #include <string>
+#include <string_view>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cctype>
+#include <type_traits>
 #include <map>
+#include <unordered_map>
 #include <list>
 #include <set>
 #include <stack>
+#include <tuple>
 #include <vector>
 #include <memory>
 #include <fstream>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <mutex>
 
-//Need Parser
-//Need <? .... ?>
 //?Need !?types
-//Need comment
-//Need parent
-//Need (Up <- tree search -> Down, All)
 //set recursive depth tree
 
+//Build with XML_STATISTICS defined to enable counters and trace hooks,
+//without it the statistics stay zero and the hot paths are not touched.
+
+struct XmlStatistics
+{
+    std::size_t bytes = 0,
+                elements = 0,
+                attributes = 0,
+                maxDepth = 0,
+                entities = 0,
+                bufferAllocations = 0; //Growth of the I/O buffers and the parser scratch strings, not the nodes an XmlReader builds
+
+    std::chrono::nanoseconds ioTime{0},
+                             parseTime{0},
+                             writeTime{0};
+
+    void clear(){ *this = XmlStatistics(); }
+};
+
+class XmlTrace
+{
+public:
+    enum Phase : unsigned char
+    {
+        Read,
+        Parse,
+        Write,
+        Flush
+    };
+
+    //Called with begin = true on scope entry and begin = false on scope exit
+    using Hook = void (*)(Phase phase, bool begin, void * user);
+
+    static void setHook(Hook hook, void * user = nullptr);
+    static Hook hook();
+    static void * user();
+};
+
 class XmlBufferReader
 {
+public:
+    enum Validation : unsigned char
+    {
+        NotValidated,
+        Valid,
+        ControlCharacter,
+        InvalidSequence,
+        ReadError //The input failed, e.g. a corrupt compressed stream, the reader tells why
+    };
+
+protected:
+    XmlStatistics _statistics;
+    Validation _validation = NotValidated;
+    std::size_t _validationOffset = 0;
+
+    //Checks UTF-8 and control characters of a whole block starting at the stream offset,
+    //returns how many leading bytes may be delivered. An incomplete sequence at the end of
+    //a non-last block is not delivered and has to be passed again with the next block.
+    std::size_t validate(const char * data, std::size_t size, std::size_t offset, bool last);
+
 public:
     explicit XmlBufferReader(){}
     virtual ~XmlBufferReader(){}
@@ -27,11 +92,19 @@ public:
     virtual bool next() = 0;
     virtual unsigned char value() = 0;
     virtual std::size_t offset() = 0;
+
+    const XmlStatistics & statistics() const { return _statistics; }
+
+    //Readers that validate blocks stop before the first rejected byte or where their input failed,
+    //otherwise the parser falls back to checking every byte
+    Validation validation() const { return _validation; }
+    std::size_t validationOffset() const { return _validationOffset; }
 };
 
 class XmlStringViewBufferReader : public XmlBufferReader
 {
     long long pos = -1;
+    std::size_t size = 0;
     std::string_view _xml;
 
 public:
@@ -43,11 +116,16 @@ public:
 
 class XmlFileBufferReader : public XmlBufferReader
 {
+    static constexpr std::size_t BlockSize = 64 * 1024;
+
     char c = 0;
-    std::size_t pos = 0;
+    std::size_t pos = 0, index = 0, size = 0, carry = 0;
+    std::unique_ptr<char[]> block;
     std::ifstream stream;
     bool is_open = false;
 
+    bool fill();
+
 public:
     explicit XmlFileBufferReader();
     bool open(const std::string & fileName);
@@ -57,12 +135,88 @@ public:
     std::size_t offset() override;
 };
 
+//Build with XML_ZLIB and/or XML_ZSTD defined (and the library linked) to get the gzip and zstd buffers.
+//Decompression runs ahead of the parser on its own thread in large blocks, unless pipelined is false.
+class XmlDecompressBufferReader : public XmlBufferReader
+{
+    struct Pipeline;
+    std::unique_ptr<Pipeline> pipeline;
+
+    char c = 0;
+    const char * data = nullptr;
+    std::size_t pos = 0, index = 0, size = 0, carry = 0;
+    char tail[4] = {};
+    bool pipelined;
+
+    bool take();
+
+protected:
+    std::string _error;
+
+    //Fills data with up to size decompressed bytes, 0 means the end of the input or an error in _error
+    virtual std::size_t decompress(char * data, std::size_t size) = 0;
+
+    //Resets the reader for a new input, nothing is decompressed unless it was opened
+    void start(bool opened);
+    void stop();
+
+public:
+    explicit XmlDecompressBufferReader(bool pipelined = true);
+    ~XmlDecompressBufferReader() override;
+
+    std::string error() const;
+    bool next() override;
+    unsigned char value() override;
+    std::size_t offset() override;
+};
+
+#ifdef XML_ZLIB
+class XmlGzipBufferReader final : public XmlDecompressBufferReader
+{
+    struct Stream;
+    std::unique_ptr<Stream> stream;
+    bool is_open = false;
+
+protected:
+    std::size_t decompress(char * data, std::size_t size) override;
+
+public:
+    explicit XmlGzipBufferReader(bool pipelined = true);
+    ~XmlGzipBufferReader() override;
+    bool open(const std::string & fileName);
+    bool isOpen();
+};
+#endif
+
+#ifdef XML_ZSTD
+class XmlZstdBufferReader final : public XmlDecompressBufferReader
+{
+    struct Stream;
+    std::unique_ptr<Stream> stream;
+    bool is_open = false;
+
+protected:
+    std::size_t decompress(char * data, std::size_t size) override;
+
+public:
+    explicit XmlZstdBufferReader(bool pipelined = true);
+    ~XmlZstdBufferReader() override;
+    bool open(const std::string & fileName);
+    bool isOpen();
+};
+#endif
+
 #include <iostream>
 
 class XmlSAXReader
 {
+    friend class XmlBatchReader;
+
     std::string _error;
     bool stop;
+    XmlStatistics _statistics;
+    std::vector<std::string> names, attributes;
+    std::string text;
 
 protected:
     void stopParse();
@@ -79,85 +233,406 @@ public:
     virtual ~XmlSAXReader();
 
     std::string error() const;
+    const XmlStatistics & statistics() const;
     bool parse(XmlBufferReader & buffer, Operation operation);
 
-    void XmlBegin(){ std::cout << "Xml begin" << std::endl;}
-    void XmlEnd(){ std::cout << "Xml end" << std::endl;}
+    //Values are passed with entities and character references decoded
+    virtual void XmlBegin(){ std::cout << "Xml begin" << std::endl;}
+    virtual void XmlEnd(){ std::cout << "Xml end" << std::endl;}
+
+    virtual void NodeBegin(const std::string & name){ std::cout << "Node: " << name << std::endl; }
+    virtual void AttributeName(const std::string & name){  std::cout << "Attribute Name: " << name << std::endl;  }
+    virtual void AttributeValue(const std::string & value){  std::cout << "Attribute Value: " << value << std::endl;  }
+    virtual void Value(const std::string & value){  std::cout << "NodeValue: " << value << std::endl;  }
+    virtual void NodeEnd(){ std::cout << "NodeEnd: " << std::endl; }
 
-    void NodeBegin(const std::string & name){ std::cout << "Node: " << name << std::endl; }
-    void AttributeName(const std::string & name){  std::cout << "Attribute Name: " << name << std::endl;  }
-    void AttributeValue(const std::string & value){  std::cout << "Attribute Value: " << value << std::endl;  }
-    void Value(const std::string & value){  std::cout << "NodeValue: " << value << std::endl;  }
-    void NodeEnd(){ std::cout << "NodeEnd: " << std::endl; }
+private:
+    bool parseBuffer(XmlBufferReader & buffer, Operation operation);
 };
 
+struct XmlDifference;
+
 class XmlNode final
 {
     friend class XmlWriter;
+    friend class XmlFrozenDocument;
+    friend class XmlIndex;
+    friend class XmlReader;
 public:
-    using Attributes = std::map<std::string, std::string>;
+    using Attributes = std::map<std::string, std::string, std::less<>>;
     using Childs = std::list<XmlNode>;
 
 private:
+    //Structural hash of a subtree, 0 until computed. Every change clears it on the path to the root.
+    struct XmlHash
+    {
+       std::atomic<std::size_t> value{0};
+
+       XmlHash(){}
+       XmlHash(const XmlHash & other):value(other.value.load(std::memory_order_relaxed)){}
+       XmlHash & operator=(const XmlHash & other){ value.store(other.value.load(std::memory_order_relaxed), std::memory_order_relaxed); return *this; }
+    };
+
+    //Output of a subtree kept by a caching XmlWriter for the settings it was written with.
+    //Copies start empty, a copy is only made to be changed.
+    struct XmlFragment
+    {
+       std::string bytes;
+       std::size_t depth = 0;
+       bool beautiful = false, valid = false;
+
+       XmlFragment(){}
+       XmlFragment(const XmlFragment &){}
+       XmlFragment & operator=(const XmlFragment &){ clear(); return *this; }
+
+       //Releases the memory too, an invalid fragment is never read again
+       void clear(){ std::string().swap(bytes); valid = false; }
+    };
+
+    struct XmlData;
+    using Contents = std::vector<std::shared_ptr<XmlData>>;
+
+    //Content of a node, shared between copies until one of them is changed
     struct XmlData
     { 
        bool sort = false;
        std::string name, value;
        Attributes attributes;
-       Childs childs;
+       Contents childs;
+       XmlHash hash;
+       XmlFragment fragment;
+
+       XmlData(){}
+       XmlData(const XmlData &) = default;
+       ~XmlData();
     };
 
-    std::shared_ptr<XmlData> data = std::make_shared<XmlData>();
+    //A node of one tree, handles of the same node share the cell. Copies share the contents but not the cells,
+    //a change clones the contents still shared on the path from the root of the tree the cell is in.
+    struct XmlCell
+    {
+       std::weak_ptr<XmlCell> parent;
+       std::shared_ptr<XmlData> data;
+       //Position of data in the childs of the parent content
+       std::size_t index = 0;
+       //Handles of the childs in the order of the content, made on the first read
+       std::atomic<Childs *> childs{nullptr};
+
+       ~XmlCell();
+    };
+
+    std::shared_ptr<XmlCell> cell;
+
+    explicit XmlNode(std::shared_ptr<XmlData> data);
+    explicit XmlNode(std::shared_ptr<XmlCell> cell);
+
+    XmlData & detach() const;
+    Childs & handles() const;
+    std::shared_ptr<XmlCell> root() const;
+    static XmlNode adopt(const XmlNode & node, const std::shared_ptr<XmlCell> & root);
+    static void store(XmlData & data, Childs & childs);
+    void clearChilds(XmlData & data) const;
+    XmlNode append(XmlNode node);
 
 public:
     explicit XmlNode();
+    explicit XmlNode(const char * nodeName, bool sort = true);
+    explicit XmlNode(std::string_view nodeName, bool sort = true);
     explicit XmlNode(const std::string & nodeName, bool sort = true);
+    explicit XmlNode(std::string && nodeName, bool sort = true);
 
     bool isValid() const;
     const std::string & nodeName() const;
 
+    //The node whose childs hold this one, invalid for a root
+    XmlNode parent() const;
+
+    //O(1), the content is shared and cloned level by level on the first change of either node
     XmlNode copy() const;
 
     std::size_t attributesCount() const;
-    Attributes & attributes();
+    //Read only, a reference kept for writing would bypass the copy on write and the cached hashes and fragments
     const Attributes & attributes() const;
-    operator Attributes & ();
     operator const Attributes & () const;
     void setAttributes(const Attributes & attributes);
-    bool containsAttribute(const std::string & attributeName) const;
-    std::string attributeValue(const std::string & attributeName) const;
+    void setAttributes(Attributes && attributes);
+
+    //Accepts maps of any other comparator, such as the std::map<std::string, std::string> Attributes used to be
+    template<typename Compare, typename Allocator>
+    void setAttributes(const std::map<std::string, std::string, Compare, Allocator> & attributes){ setAttributes(Attributes(attributes.begin(), attributes.end())); }
+    bool containsAttribute(std::string_view attributeName) const;
+    std::string attributeValue(std::string_view attributeName) const;
+    void addAttribute(const char * attributeName, const char * value);
+    void addAttribute(std::string_view attributeName, std::string_view value);
     void addAttribute(const std::string & attributeName, const std::string & value);
-    void removeAttribute(const std::string & attributeName);
+    void addAttribute(std::string && attributeName, std::string && value);
+    void removeAttribute(std::string_view attributeName);
     void clearAttributes();
 
+    //Adds the attribute constructing the value from args, an existing attribute is left untouched
+    template<typename... Args>
+    bool emplaceAttribute(std::string_view attributeName, Args &&... args)
+    {
+        Attributes & attributes = detach().attributes;
+        auto iter = attributes.lower_bound(attributeName);
+        if(iter != attributes.end() && iter->first == attributeName) return false;
+        attributes.emplace_hint(iter, std::piecewise_construct, std::forward_as_tuple(attributeName), std::forward_as_tuple(std::forward<Args>(args)...));
+        return true;
+    }
+
     bool isValue() const;
     const std::string & value() const;
     operator const std::string &() const;
     void setValue(const char * value);
     void setValue(std::string_view value);
     void setValue(const std::string & value);
+    void setValue(std::string && value);
 
     bool isChilds() const;
     std::size_t childsCount() const;
+    //Handles of the childs, made on the first read. Their changes go to this tree, also while its content is shared with a copy.
     const Childs & childs() const;
     operator const Childs & () const;
     void setChilds(const Childs & childs);
-    bool containsChild(const std::string & nodeName) const;
-    std::vector<XmlNode> child(const std::string & nodeName) const;
+    void setChilds(Childs && childs);
+    bool containsChild(std::string_view nodeName) const;
+    std::vector<XmlNode> child(std::string_view nodeName) const;
+    //A node that already has a parent or is the root of this tree is added as a copy,
+    //changes through its handle stay in the tree it was in
     bool addChild(const XmlNode & node);
-    void removeChild(const std::string & nodeName);
+    bool addChild(XmlNode && node);
+    void removeChild(std::string_view nodeName);
+
+    //Constructs the child from the XmlNode constructor args, returns it or an invalid node
+    template<typename... Args>
+    XmlNode emplaceChild(Args &&... args){ return append(XmlNode(std::forward<Args>(args)...)); }
+
+    //Hash of name, value, attributes and childs, cached per subtree so unchanged subtrees are not hashed again
+    std::size_t hash() const;
+    //Subtrees with the same content or different hashes are decided without walking them
+    bool equals(const XmlNode & other) const;
+    //Subtrees with equal hashes are taken as unchanged, so the cost follows the size of the changes
+    std::vector<XmlDifference> diff(const XmlNode & other) const;
 
     bool operator<(const XmlNode & other) const;
 };
 
+//Childs are matched by hash first and then by name in order.
+//Added has only after, Removed only before, Changed both: the name, value or attributes differ,
+//or for a node with otherwise equal childs their order.
+struct XmlDifference
+{
+    enum Kind {Added, Removed, Changed};
+
+    Kind kind;
+    XmlNode before, after;
+};
+
+class XmlReader final : public XmlSAXReader
+{
+    XmlNode root;
+    std::vector<XmlNode::XmlData *> stack;
+    std::string attribute;
+
+    void XmlBegin() override;
+    void XmlEnd() override;
+    void NodeBegin(const std::string & name) override;
+    void AttributeName(const std::string & name) override;
+    void AttributeValue(const std::string & value) override;
+    void Value(const std::string & value) override;
+    void NodeEnd() override;
+
+public:
+    explicit XmlReader();
+    bool read(XmlBufferReader & buffer, XmlNode & node);
+    bool read(std::string_view xml, XmlNode & node);
+    XmlNode read(std::string_view xml);
+    bool readFromFile(const std::string & fileName, XmlNode & node);
+};
+
+class XmlFrozenDocument;
+
+//Non-owning read-only handle into an XmlFrozenDocument, copying it touches no reference counters
+class XmlFrozenNode final
+{
+    friend class XmlFrozenDocument;
+
+    const XmlFrozenDocument * document = nullptr;
+    std::size_t index = 0;
+
+    explicit XmlFrozenNode(const XmlFrozenDocument * document, std::size_t index);
+
+public:
+    explicit XmlFrozenNode();
+
+    bool isValid() const;
+    std::string_view nodeName() const;
+    XmlFrozenNode parent() const;
+
+    std::size_t attributesCount() const;
+    std::pair<std::string_view, std::string_view> attribute(std::size_t index) const;
+    bool containsAttribute(std::string_view attributeName) const;
+    std::string_view attributeValue(std::string_view attributeName) const;
+
+    bool isValue() const;
+    std::string_view value() const;
+
+    bool isChilds() const;
+    std::size_t childsCount() const;
+    XmlFrozenNode child(std::size_t index) const;
+    XmlFrozenNode child(std::string_view nodeName) const;
+    bool containsChild(std::string_view nodeName) const;
+};
+
+//Immutable flat copy of an XmlNode tree, the children of a node are stored next to each other
+//and all strings live in one pool. Safe to read from any number of threads.
+class XmlFrozenDocument final
+{
+    friend class XmlFrozenNode;
+
+    struct Node
+    {
+        std::size_t parent, name, nameSize, value, valueSize, attributes, attributesCount, childs, childsCount;
+    };
+
+    struct Attribute
+    {
+        std::size_t name, nameSize, value, valueSize;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Attribute> attributes;
+    std::string strings;
+
+    std::string_view string(std::size_t offset, std::size_t size) const { return std::string_view(strings.data() + offset, size); }
+
+public:
+    explicit XmlFrozenDocument();
+    explicit XmlFrozenDocument(const XmlNode & node);
+
+    bool isValid() const;
+    XmlFrozenNode root() const;
+    std::size_t nodesCount() const;
+};
+
+//Publishes frozen documents for hot reloads. Readers keep using the document they hold
+//while a new one is published and pick it up with a short lock on their next refresh().
+class XmlSnapshot final
+{
+    mutable std::mutex mutex;
+    std::shared_ptr<const XmlFrozenDocument> current;
+    std::atomic<std::size_t> version{0};
+
+public:
+    //Per thread cache of a published document. document() and root() keep returning the document it holds,
+    //so the XmlFrozenNodes read from it stay valid until the caller moves to a newer one with refresh(),
+    //e.g. between two requests. refresh() only touches the shared pointer when a new document was published.
+    //To keep an older document alive past refresh() hold the pointer returned by XmlSnapshot::load().
+    class Reader final
+    {
+        const XmlSnapshot & snapshot;
+        std::shared_ptr<const XmlFrozenDocument> current;
+        std::size_t version = 0;
+
+    public:
+        explicit Reader(const XmlSnapshot & snapshot);
+        //Returns true when it moved to a newer document, the nodes read before are invalid then
+        bool refresh();
+        const XmlFrozenDocument & document() const;
+        XmlFrozenNode root() const;
+    };
+
+    explicit XmlSnapshot();
+    explicit XmlSnapshot(const XmlNode & node);
+
+    void publish(const XmlNode & node);
+    void publish(std::shared_ptr<const XmlFrozenDocument> document);
+    std::shared_ptr<const XmlFrozenDocument> load() const;
+};
+
+//Preorder table of a document with the nodes grouped by name, built once and shared by queries.
+//It holds handles to the nodes, build it again after the document was changed.
+class XmlIndex final
+{
+    friend class XmlQuery;
+
+    struct Entry
+    {
+        XmlNode node;
+        std::size_t parent, end;
+    };
+
+    std::vector<Entry> nodes;
+    std::map<std::string, std::vector<std::size_t>, std::less<>> names;
+    std::unordered_map<const void *, std::size_t> cells;
+
+    std::size_t find(const XmlNode & node) const;
+
+public:
+    explicit XmlIndex();
+    explicit XmlIndex(const XmlNode & node);
+
+    void build(const XmlNode & node);
+    bool isValid() const;
+    XmlNode root() const;
+    std::size_t nodesCount() const;
+};
+
+//Compiled XPath subset, reusable for any number of documents and threads:
+//absolute and relative paths, / and // steps, the child::, parent:: and self:: axes, . and .., names and *,
+//predicates [@name], [@name='value'], [n] and [last()]. Positions count among the selected children
+//of the same parent, as for //name[n] in XPath.
+class XmlQuery final
+{
+    enum Axis {Child, Descendant, Parent, Self};
+
+    struct Predicate
+    {
+        enum Kind {Attribute, AttributeValue, Position, Last} kind;
+        std::string name, value;
+        std::size_t position = 0;
+    };
+
+    struct Step
+    {
+        Axis axis;
+        std::string name;
+        std::vector<Predicate> predicates;
+    };
+
+    std::vector<Step> steps;
+    bool absolute = false;
+    std::string _error;
+
+    std::vector<XmlNode> select(const XmlIndex & index, std::vector<std::size_t> && context) const;
+
+public:
+    explicit XmlQuery();
+    explicit XmlQuery(std::string_view expression);
+
+    bool compile(std::string_view expression);
+    bool isValid() const;
+    std::string error() const;
+
+    //Relative queries start at the root of the index or at context, which must be one of its nodes
+    std::vector<XmlNode> select(const XmlIndex & index) const;
+    std::vector<XmlNode> select(const XmlIndex & index, const XmlNode & context) const;
+};
+
 class XmlBufferWriter
 {
+protected:
+    XmlStatistics _statistics;
+
 public:
     explicit XmlBufferWriter(){}
     virtual ~XmlBufferWriter(){}
 
     virtual bool write(unsigned char ch) = 0;
+    virtual bool write(std::string_view block);
     virtual std::size_t writeCount() = 0;
+
+    const XmlStatistics & statistics() const { return _statistics; }
 };
 
 class XmlStringBufferWriter : public XmlBufferWriter
@@ -168,24 +643,90 @@ class XmlStringBufferWriter : public XmlBufferWriter
 public:
     explicit XmlStringBufferWriter();
     bool write(unsigned char ch) override;
+    bool write(std::string_view block) override;
     std::size_t writeCount() override;
     const std::string & result() const;
 };
 
 class XmlFileBufferWriter : public XmlBufferWriter
 {
-    std::size_t count = 0;
+    static constexpr std::size_t BlockSize = 64 * 1024;
+
+    std::size_t count = 0, size = 0;
+    std::unique_ptr<char[]> block;
     std::ofstream stream;
     bool is_open = false;
 
 public:
     explicit XmlFileBufferWriter();
+    ~XmlFileBufferWriter() override;
     bool open(const std::string & fileName);
     bool isOpen();
+    bool flush();
     bool write(unsigned char ch) override;
+    bool write(std::string_view block) override;
     std::size_t writeCount() override;
 };
 
+//Collects the output in large blocks and hands every full block to compress
+class XmlCompressBufferWriter : public XmlBufferWriter
+{
+    static constexpr std::size_t BlockSize = 256 * 1024;
+
+    std::size_t count = 0, size = 0;
+    std::unique_ptr<char[]> block;
+
+protected:
+    std::string _error;
+    bool is_open = false;
+
+    //finish is true for the last call of a stream, it may come with size 0
+    virtual bool compress(const char * data, std::size_t size, bool finish) = 0;
+    void reset();
+
+public:
+    explicit XmlCompressBufferWriter();
+
+    std::string error() const;
+    bool isOpen();
+    bool close();
+    bool write(unsigned char ch) override;
+    bool write(std::string_view block) override;
+    std::size_t writeCount() override;
+};
+
+#ifdef XML_ZLIB
+class XmlGzipBufferWriter final : public XmlCompressBufferWriter
+{
+    struct Stream;
+    std::unique_ptr<Stream> stream;
+
+protected:
+    bool compress(const char * data, std::size_t size, bool finish) override;
+
+public:
+    explicit XmlGzipBufferWriter();
+    ~XmlGzipBufferWriter() override;
+    bool open(const std::string & fileName, int level = 6);
+};
+#endif
+
+#ifdef XML_ZSTD
+class XmlZstdBufferWriter final : public XmlCompressBufferWriter
+{
+    struct Stream;
+    std::unique_ptr<Stream> stream;
+
+protected:
+    bool compress(const char * data, std::size_t size, bool finish) override;
+
+public:
+    explicit XmlZstdBufferWriter();
+    ~XmlZstdBufferWriter() override;
+    bool open(const std::string & fileName, int level = 3);
+};
+#endif
+
 class XmlSAXWriter
 {
     bool beautiful = false;
@@ -201,35 +742,574 @@ class XmlSAXWriter
         NodeEnd
     };
 
-    std::stack<std::tuple<Сondition, std::string, std::set<std::string>>> stack;
+    std::stack<std::tuple<Сondition, std::string, std::set<std::string, std::less<>>>> stack;
 
     bool checkBuffer();
+    bool validate(std::string_view string);
     bool writeChar(unsigned char ch);
     bool writeSpace(int count);
-    bool writeName(const std::string & name);
+    bool writeName(std::string_view name);
     bool writeString(std::string_view string);
-    bool writeValue(const std::string & value, bool isAttrebute);
+    bool writeValue(std::string_view value, bool isAttrebute);
+
+protected:
+    XmlStatistics _statistics;
+
+    //Ends the begin tag of the open node before its first child
+    bool beginChild();
+    //Writes a whole child node serialized before with the same settings at the same depth
+    bool writeFragment(std::string_view fragment);
+    //Goes on writing into another buffer, the open nodes and the statistics are kept
+    void switchBuffer(XmlBufferWriter * buffer);
 
 public:
     explicit XmlSAXWriter();
     std::string error() const;
+    const XmlStatistics & statistics() const;
     void setBuffer(XmlBufferWriter * buffer, bool beautiful = false);
 
-    bool NodeBegin(const std::string & name);
-    bool AttributeName(const std::string & name);
-    bool AttributeValue(const std::string & value);
-    bool Value(const std::string & value);
+    bool NodeBegin(std::string_view name);
+    bool AttributeName(std::string_view name);
+    bool AttributeValue(std::string_view value);
+    bool Value(std::string_view value);
     bool NodeEnd();
 };
 
 class XmlWriter final : public XmlSAXWriter
 {
+    bool caching = false;
+
+    struct Level
+    {
+        XmlNode::XmlData * data;
+        bool entered, owned;
+        XmlNode::Contents::const_iterator iter;
+        const XmlNode::Childs * handles;
+        XmlNode::Childs::const_iterator handle;
+        std::size_t offset;
+    };
+
+    static Level level(XmlNode::XmlData * data, bool owned, const XmlNode::Childs * handles);
+    static Level root(const XmlNode & node);
+    static Level next(Level & level);
+    bool writeNode(XmlBufferWriter & buffer, const XmlNode & node, bool beautiful);
+    bool writeCached(XmlBufferWriter & buffer, const XmlNode & node, bool beautiful);
+
 public:
     explicit XmlWriter();
+
+    //Keeps the output of every subtree in the tree and copies unchanged subtrees on the next write.
+    //A change drops the cached output on the path to the root. Output is kept only in contents the tree holds alone,
+    //contents still shared with copies are read from but not written to, so copies can be written on any threads.
+    //The statistics of a caching write count the nodes serialized again, copied subtrees count only their bytes.
+    void setCaching(bool caching);
+    bool isCaching() const;
+    //Releases the output cached in the contents the tree holds alone, turning caching off keeps it
+    static void clearCache(const XmlNode & node);
+
     bool write(XmlBufferWriter & buffer, const XmlNode & node, bool beautiful = false);
     bool write(std::string & string, const XmlNode & json, bool beautiful = false);
     std::string write(const XmlNode & json, bool beautiful = false);
     bool writeToFile(const std::string & fileName, const XmlNode & node, bool beautiful = false);
 };
 
+class XmlBatchReader final
+{
+    class Pool;
+    std::unique_ptr<Pool> pool;
+
+public:
+    enum Delivery : unsigned char
+    {
+        Ordered,
+        Completed
+    };
+
+    struct Document
+    {
+        std::size_t index = 0;
+        bool success = false;
+        std::string error;
+        XmlNode node;
+    };
+
+    using Callback = std::function<void(Document & document)>;
+    using ReaderFactory = std::function<std::unique_ptr<XmlSAXReader>()>;
+    using Done = std::function<void(std::size_t index, XmlSAXReader & reader, bool success)>;
+
+    //threads = 0 uses the hardware concurrency, the workers and their readers live as long as the object
+    explicit XmlBatchReader(std::size_t threads = 0);
+    ~XmlBatchReader();
+
+    std::size_t threads() const;
+
+    //Every document is parsed into an XmlNode on the workers, callback runs on the calling thread.
+    //An exception thrown on a worker is rethrown here in place of the delivery of its document,
+    //the documents due before it are delivered first.
+    void readFiles(const std::vector<std::string> & fileNames, const Callback & callback, Delivery delivery = Ordered);
+    void readBuffers(const std::vector<std::string_view> & buffers, const Callback & callback, Delivery delivery = Ordered);
+    std::size_t readStream(std::string_view xml, const Callback & callback, Delivery delivery = Ordered);
+
+    //Every worker sends the events to its own reader made by factory once per call,
+    //done runs on the worker when a document is completed.
+    //The first exception thrown by a reader or done on a worker is rethrown here once the workers are idle.
+    void parseFiles(const std::vector<std::string> & fileNames, const ReaderFactory & factory, const Done & done);
+    void parseBuffers(const std::vector<std::string_view> & buffers, const ReaderFactory & factory, const Done & done);
+    std::size_t parseStream(std::string_view xml, const ReaderFactory & factory, const Done & done);
+
+    //Splits concatenated documents after every root node, leading comments and instructions go with the next root
+    static std::vector<std::string_view> split(std::string_view xml);
+};
+
+//Binds the members of T to attributes, child elements and the text of an element, specialize it per struct:
+//
+//    template<> struct XmlSchema<Point>
+//    {
+//        static constexpr auto fields = std::make_tuple(xmlAttribute("x", &Point::x), xmlElement("label", &Point::label));
+//    };
+//
+//Members can be strings, numbers, bool, structs with a schema and vectors of them for repeated elements.
+//Unknown elements and attributes are skipped. A schema has at most one xmlValue field and then no xmlElement fields.
+template<typename T>
+struct XmlSchema;
+
+enum class XmlFieldKind : unsigned char
+{
+    Attribute,
+    Element,
+    Value
+};
+
+template<XmlFieldKind Kind, typename Class, typename Member>
+struct XmlField
+{
+    static constexpr XmlFieldKind kind = Kind;
+
+    std::string_view name;
+    Member Class::* member;
+};
+
+template<typename Class, typename Member>
+constexpr XmlField<XmlFieldKind::Attribute, Class, Member> xmlAttribute(std::string_view name, Member Class::* member){ return {name, member}; }
+template<typename Class, typename Member>
+constexpr XmlField<XmlFieldKind::Element, Class, Member> xmlElement(std::string_view name, Member Class::* member){ return {name, member}; }
+template<typename Class, typename Member>
+constexpr XmlField<XmlFieldKind::Value, Class, Member> xmlValue(Member Class::* member){ return {std::string_view(), member}; }
+
+template<typename T>
+concept XmlBindStruct = requires { XmlSchema<T>::fields; };
+
+template<typename T>
+struct XmlBindVector : std::false_type {};
+template<typename T, typename Allocator>
+struct XmlBindVector<std::vector<T, Allocator>> : std::true_type { using type = T; };
+
+constexpr std::size_t xmlNameHash(std::string_view name, std::size_t seed)
+{
+    std::size_t hash = 14695981039346656037ull ^ seed;
+
+    for(char ch : name)
+    {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+//Perfect hash over the names of a schema, built at compile time. Names that found no seed are searched in order.
+template<std::size_t N>
+struct XmlNameTable
+{
+    static constexpr std::size_t Size = (N == 0) ? 1 : std::bit_ceil(2 * N);
+
+    std::array<std::string_view, N> names{};
+    std::array<std::size_t, N> fields{};
+    std::array<std::size_t, Size> slots{};
+    std::size_t seed = 0;
+    bool perfect = false;
+
+    constexpr XmlNameTable(const std::array<std::string_view, N> & names, const std::array<std::size_t, N> & fields):names(names), fields(fields)
+    {
+        for(std::size_t candidate = 0; candidate < 64 && !perfect; candidate++)
+        {
+            slots.fill(0);
+            perfect = true;
+
+            for(std::size_t i = 0; i < N && perfect; i++)
+            {
+                std::size_t & slot = slots[xmlNameHash(names[i], candidate) & (Size - 1)];
+                if(slot != 0) perfect = false;
+                else slot = i + 1;
+            }
+
+            seed = candidate;
+        }
+    }
+
+    //Index of the field named name in the schema or npos
+    constexpr std::size_t find(std::string_view name) const
+    {
+        if(perfect)
+        {
+           const std::size_t slot = slots[xmlNameHash(name, seed) & (Size - 1)];
+           return (slot != 0 && names[slot - 1] == name) ? fields[slot - 1] : std::string::npos;
+        }
+
+        for(std::size_t i = 0; i < N; i++){ if(names[i] == name) return fields[i]; }
+        return std::string::npos;
+    }
+};
+
+template<typename T>
+bool xmlBindRead(std::string_view text, T & value)
+{
+    if constexpr(std::is_same_v<T, std::string>)
+    {
+        value.assign(text);
+        return true;
+    }
+    else
+    {
+        while(!text.empty() && std::isspace(static_cast<unsigned char>(text.front())) != 0) text.remove_prefix(1);
+        while(!text.empty() && std::isspace(static_cast<unsigned char>(text.back())) != 0) text.remove_suffix(1);
+
+        if constexpr(std::is_same_v<T, bool>)
+        {
+            if(text == "true" || text == "1") value = true;
+            else if(text == "false" || text == "0") value = false;
+            else return false;
+            return true;
+        }
+        else
+        {
+            const char * const end = text.data() + text.size();
+            const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+            return ec == std::errc() && ptr == end;
+        }
+    }
+}
+
+//Formats value into buffer unless it is a string, which is returned as is
+template<typename T>
+std::string_view xmlBindWrite(const T & value, std::array<char, 64> & buffer)
+{
+    if constexpr(std::is_same_v<T, std::string>) return value;
+    else if constexpr(std::is_same_v<T, bool>) return value ? "true" : "false";
+    else
+    {
+        const auto [ptr, ec] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+        return (ec == std::errc()) ? std::string_view(buffer.data(), static_cast<std::size_t>(ptr - buffer.data())) : std::string_view();
+    }
+}
+
+//Type erased handlers of one bound type, a frame of XmlBindReader points to the table of its element
+struct XmlBinder
+{
+    struct Frame
+    {
+        void * object;
+        const XmlBinder * binder;
+        std::string_view name;
+        std::string text;
+    };
+
+    //false means an invalid value, unknown names are accepted and skipped
+    bool (*attribute)(void * object, std::string_view name, std::string_view value);
+    //false means an unknown element, the frame is filled for a known one
+    bool (*element)(void * object, std::string_view name, Frame & frame);
+    bool (*value)(void * object, std::string_view text);
+};
+
+template<typename T>
+struct XmlBind
+{
+    static bool attribute(void *, std::string_view, std::string_view){ return true; }
+    static bool element(void *, std::string_view, XmlBinder::Frame &){ return false; }
+    static bool value(void * object, std::string_view text){ return xmlBindRead(text, *static_cast<T *>(object)); }
+
+    static constexpr XmlBinder binder{attribute, element, value};
+};
+
+template<XmlBindStruct T>
+struct XmlBind<T>
+{
+    static constexpr auto & fields = XmlSchema<T>::fields;
+    static constexpr std::size_t Count = std::tuple_size_v<std::remove_cvref_t<decltype(XmlSchema<T>::fields)>>;
+
+    template<std::size_t I>
+    using Field = std::remove_cvref_t<std::tuple_element_t<I, std::remove_cvref_t<decltype(XmlSchema<T>::fields)>>>;
+
+    template<XmlFieldKind Kind>
+    static constexpr std::size_t count()
+    {
+        return [&]<std::size_t... I>(std::index_sequence<I...>){ return ((Field<I>::kind == Kind ? 1 : 0) + ... + 0); }(std::make_index_sequence<Count>());
+    }
+
+    template<XmlFieldKind Kind>
+    static constexpr auto table()
+    {
+        std::array<std::string_view, count<Kind>()> names{};
+        std::array<std::size_t, count<Kind>()> indexes{};
+        std::size_t next = 0;
+
+        [&]<std::size_t... I>(std::index_sequence<I...>)
+        {
+            ((Field<I>::kind == Kind ? (names[next] = std::get<I>(fields).name, indexes[next] = I, next++) : 0), ...);
+        }(std::make_index_sequence<Count>());
+
+        return XmlNameTable<count<Kind>()>(names, indexes);
+    }
+
+    //The text of a node binds to one member and cannot be written next to child elements
+    static_assert(count<XmlFieldKind::Value>() <= 1, "XmlSchema: more than one xmlValue field");
+    static_assert(count<XmlFieldKind::Value>() == 0 || count<XmlFieldKind::Element>() == 0, "XmlSchema: an xmlValue field cannot be combined with xmlElement fields");
+
+    static constexpr auto attributes = table<XmlFieldKind::Attribute>();
+    static constexpr auto elements = table<XmlFieldKind::Element>();
+
+    template<std::size_t I>
+    static bool attributeField(void * object, std::string_view value)
+    {
+        if constexpr(Field<I>::kind == XmlFieldKind::Attribute) return xmlBindRead(value, static_cast<T *>(object)->*std::get<I>(fields).member);
+        else return true;
+    }
+
+    template<std::size_t I>
+    static void elementField(void * object, XmlBinder::Frame & frame)
+    {
+        if constexpr(Field<I>::kind == XmlFieldKind::Element) elementMember<I>(object, frame);
+    }
+
+    template<std::size_t I>
+    static void elementMember(void * object, XmlBinder::Frame & frame)
+    {
+        using Member = std::remove_cvref_t<decltype(static_cast<T *>(object)->*std::get<I>(fields).member)>;
+        Member & member = static_cast<T *>(object)->*std::get<I>(fields).member;
+        frame.name = std::get<I>(fields).name;
+
+        if constexpr(XmlBindVector<Member>::value)
+        {
+            frame.object = &member.emplace_back();
+            frame.binder = &XmlBind<typename XmlBindVector<Member>::type>::binder;
+        }
+        else
+        {
+            frame.object = &member;
+            frame.binder = &XmlBind<Member>::binder;
+        }
+    }
+
+    template<std::size_t... I>
+    static constexpr std::array<bool (*)(void *, std::string_view), Count> attributeFields(std::index_sequence<I...>){ return {&attributeField<I>...}; }
+    template<std::size_t... I>
+    static constexpr std::array<void (*)(void *, XmlBinder::Frame &), Count> elementFields(std::index_sequence<I...>){ return {&elementField<I>...}; }
+
+    static bool attribute(void * object, std::string_view name, std::string_view value)
+    {
+        static constexpr auto dispatch = attributeFields(std::make_index_sequence<Count>());
+        const std::size_t index = attributes.find(name);
+        return index == std::string::npos || dispatch[index](object, value);
+    }
+
+    static bool element(void * object, std::string_view name, XmlBinder::Frame & frame)
+    {
+        static constexpr auto dispatch = elementFields(std::make_index_sequence<Count>());
+        const std::size_t index = elements.find(name);
+        if(index == std::string::npos) return false;
+        dispatch[index](object, frame);
+        return true;
+    }
+
+    template<std::size_t I>
+    static bool valueField(void * object, std::string_view text)
+    {
+        if constexpr(Field<I>::kind == XmlFieldKind::Value) return xmlBindRead(text, static_cast<T *>(object)->*std::get<I>(fields).member);
+        else return true;
+    }
+
+    static bool value(void * object, std::string_view text)
+    {
+        bool ret = true;
+
+        [&]<std::size_t... I>(std::index_sequence<I...>)
+        {
+            ((Field<I>::kind == XmlFieldKind::Value ? (ret = ret && valueField<I>(object, text)) : ret), ...);
+        }(std::make_index_sequence<Count>());
+
+        return ret;
+    }
+
+    static constexpr XmlBinder binder{attribute, element, (count<XmlFieldKind::Value>() > 0) ? value : nullptr};
+};
+
+//Parses straight into T from the SAX events, without building an XmlNode tree.
+//The frames and text buffers are reused, so reading many documents allocates only for the struct itself.
+template<typename T>
+class XmlBindReader final : public XmlSAXReader
+{
+    T * object = nullptr;
+    std::string_view root;
+    std::vector<XmlBinder::Frame> frames;
+    std::size_t depth = 0;
+    std::string attribute, _error;
+
+    void fail(std::string error)
+    {
+        if(!_error.empty()) return;
+        _error = std::move(error);
+        stopParse();
+    }
+
+    void XmlBegin() override { depth = 0; }
+    void XmlEnd() override {}
+
+    void NodeBegin(const std::string & name) override
+    {
+        if(depth == frames.size()) frames.emplace_back();
+        XmlBinder::Frame & frame = frames[depth];
+        frame.text.clear();
+
+        if(depth == 0)
+        {
+           if(!root.empty() && name != root) fail("Unexpected root node '" + name + "'");
+           frame.object = object;
+           frame.binder = &XmlBind<T>::binder;
+           frame.name = root;
+        }
+        else
+        {
+           XmlBinder::Frame & parent = frames[depth - 1];
+           if(parent.binder == nullptr || !parent.binder->element(parent.object, name, frame)) frame.binder = nullptr;
+        }
+
+        depth++;
+    }
+
+    void AttributeName(const std::string & name) override { attribute.assign(name); }
+
+    void AttributeValue(const std::string & value) override
+    {
+        const XmlBinder::Frame & frame = frames[depth - 1];
+        if(frame.binder != nullptr && !frame.binder->attribute(frame.object, attribute, value)) fail("Invalid value of attribute '" + attribute + "'");
+    }
+
+    void Value(const std::string & value) override
+    {
+        XmlBinder::Frame & frame = frames[depth - 1];
+        if(frame.binder != nullptr && frame.binder->value != nullptr) frame.text.append(value);
+    }
+
+    void NodeEnd() override
+    {
+        const XmlBinder::Frame & frame = frames[--depth];
+        if(frame.binder == nullptr || frame.binder->value == nullptr || frame.text.empty()) return;
+        if(!frame.binder->value(frame.object, frame.text)) fail("Invalid value of node '" + std::string(frame.name) + "'");
+    }
+
+public:
+    //root is the expected name of the root node, empty accepts any
+    explicit XmlBindReader(std::string_view root = std::string_view()):root(root){}
+
+    std::string error() const { return _error.empty() ? XmlSAXReader::error() : _error; }
+
+    bool read(XmlBufferReader & buffer, T & value)
+    {
+        object = &value;
+        _error.clear();
+        const bool ret = parse(buffer, Single) && _error.empty();
+        object = nullptr;
+        return ret;
+    }
+
+    bool read(std::string_view xml, T & value)
+    {
+        XmlStringViewBufferReader buffer(xml);
+        return read(buffer, value);
+    }
+
+    bool readFromFile(const std::string & fileName, T & value)
+    {
+        XmlFileBufferReader buffer;
+        return buffer.open(fileName) && read(buffer, value);
+    }
+};
+
+//Writes T through the XmlSAXWriter events: attributes, then the value, then the elements in schema order
+template<typename T>
+class XmlBindWriter final : public XmlSAXWriter
+{
+    std::array<char, 64> number{};
+
+    template<typename Member>
+    bool writeElement(std::string_view name, const Member & member)
+    {
+        if constexpr(XmlBindVector<Member>::value)
+        {
+            for(const auto & item : member){ if(!writeElement(name, item)) return false; }
+            return true;
+        }
+        else if constexpr(XmlBindStruct<Member>)
+        {
+            return writeStruct(name, member);
+        }
+        else
+        {
+            if(!NodeBegin(name)) return false;
+            const std::string_view text = xmlBindWrite(member, number);
+            if(!text.empty() && !Value(text)) return false;
+            return NodeEnd();
+        }
+    }
+
+    template<typename Struct>
+    bool writeStruct(std::string_view name, const Struct & object)
+    {
+        constexpr auto & fields = XmlSchema<Struct>::fields;
+        if(!NodeBegin(name)) return false;
+
+        const auto write = [&]<XmlFieldKind Kind>(const auto & field)
+        {
+            const auto & member = object.*field.member;
+
+            if constexpr(std::remove_cvref_t<decltype(field)>::kind != Kind) return true;
+            else if constexpr(Kind == XmlFieldKind::Attribute) return AttributeName(field.name) && AttributeValue(xmlBindWrite(member, number));
+            else if constexpr(Kind == XmlFieldKind::Value)
+            {
+                const std::string_view text = xmlBindWrite(member, number);
+                return text.empty() || Value(text);
+            }
+            else return writeElement(field.name, member);
+        };
+
+        const bool ret = std::apply([&](const auto &... field){ return (write.template operator()<XmlFieldKind::Attribute>(field) && ...) &&
+                                                                       (write.template operator()<XmlFieldKind::Value>(field) && ...) &&
+                                                                       (write.template operator()<XmlFieldKind::Element>(field) && ...); }, fields);
+        return ret && NodeEnd();
+    }
+
+public:
+    explicit XmlBindWriter(){}
+
+    bool write(XmlBufferWriter & buffer, std::string_view root, const T & object, bool beautiful = false)
+    {
+        setBuffer(&buffer, beautiful);
+        return writeStruct(root, object);
+    }
+
+    bool write(std::string & string, std::string_view root, const T & object, bool beautiful = false)
+    {
+        XmlStringBufferWriter buffer;
+        if(!write(buffer, root, object, beautiful)) return false;
+        string = std::move(const_cast<std::string &>(buffer.result()));
+        return true;
+    }
+
+    bool writeToFile(const std::string & fileName, std::string_view root, const T & object, bool beautiful = false)
+    {
+        XmlFileBufferWriter buffer;
+        return buffer.open(fileName) && write(buffer, root, object, beautiful) && buffer.flush();
+    }
+};
+
 #endif // XML_H
@@ -0,0 +1,511 @@
+//Regression tests, build with: g++ -std=c++20 -pthread XmlTest.cpp Xml.cpp
+//Run a -fsanitize=thread build as well, the concurrent reads must stay free of races.
+
+#include "Xml.h"
+
+#include <barrier>
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+struct Point
+{
+    int x = 0;
+    double y = 0;
+    std::string label;
+};
+
+struct Tag
+{
+    std::string key, text;
+};
+
+struct Shape
+{
+    std::string id;
+    bool visible = false;
+    unsigned short count = 0;
+    Point origin;
+    std::vector<Point> points;
+    std::vector<Tag> tags;
+    std::vector<int> sizes;
+};
+
+template<> struct XmlSchema<Point>
+{
+    static constexpr auto fields = std::make_tuple(xmlAttribute("x", &Point::x), xmlAttribute("y", &Point::y), xmlElement("label", &Point::label));
+};
+
+template<> struct XmlSchema<Tag>
+{
+    static constexpr auto fields = std::make_tuple(xmlAttribute("key", &Tag::key), xmlValue(&Tag::text));
+};
+
+template<> struct XmlSchema<Shape>
+{
+    static constexpr auto fields = std::make_tuple(xmlAttribute("id", &Shape::id), xmlAttribute("visible", &Shape::visible), xmlElement("count", &Shape::count),
+                                                   xmlElement("origin", &Shape::origin), xmlElement("point", &Shape::points),
+                                                   xmlElement("tag", &Shape::tags), xmlElement("size", &Shape::sizes));
+};
+
+static bool samePoint(const Point & a, const Point & b){ return a.x == b.x && a.y == b.y && a.label == b.label; }
+
+static XmlNode makeTree()
+{
+    XmlNode root("root", false);
+
+    for(int i = 0; i < 8; i++)
+    {
+        XmlNode x("x", false);
+        XmlNode y("y", false);
+        y.setValue(std::to_string(i));
+        x.addChild(y);
+        x.addAttribute("i", std::to_string(i));
+        root.addChild(x);
+    }
+
+    return root;
+}
+
+//Rejected UTF-8 and control characters are reported at the start of their sequence wherever it falls in the blocks
+static void testUtf8Validation()
+{
+    struct Case { std::string bytes; XmlBufferReader::Validation validation; };
+
+    const std::vector<Case> cases =
+    {
+        {"\xC3\xA9", XmlBufferReader::Valid}, {"\xE2\x82\xAC", XmlBufferReader::Valid}, {"\xED\x9F\xBF", XmlBufferReader::Valid},
+        {"\xF0\x9D\x84\x9E", XmlBufferReader::Valid}, {"\xF4\x8F\xBF\xBF", XmlBufferReader::Valid}, {"\t\r\n", XmlBufferReader::Valid},
+        {"\xC0\x80", XmlBufferReader::InvalidSequence}, {"\xC1\xBF", XmlBufferReader::InvalidSequence},
+        {"\xE0\x80\x80", XmlBufferReader::InvalidSequence}, {"\xE0\x9F\xBF", XmlBufferReader::InvalidSequence},
+        {"\xF0\x80\x80\x80", XmlBufferReader::InvalidSequence}, {"\xF0\x8F\xBF\xBF", XmlBufferReader::InvalidSequence},
+        {"\xED\xA0\x80", XmlBufferReader::InvalidSequence}, {"\xED\xBF\xBF", XmlBufferReader::InvalidSequence},
+        {"\xF4\x90\x80\x80", XmlBufferReader::InvalidSequence}, {"\xF5\x80\x80\x80", XmlBufferReader::InvalidSequence},
+        {"\xFF", XmlBufferReader::InvalidSequence}, {"\x80", XmlBufferReader::InvalidSequence}, {"\xE2\x82" "A", XmlBufferReader::InvalidSequence},
+        {std::string(1, '\0'), XmlBufferReader::ControlCharacter}, {"\x01", XmlBufferReader::ControlCharacter}, {"\x08", XmlBufferReader::ControlCharacter},
+        {"\x0E", XmlBufferReader::ControlCharacter}, {"\x1F", XmlBufferReader::ControlCharacter}, {"\x7F", XmlBufferReader::ControlCharacter}
+    };
+
+    //Truncated sequences are rejected only at the end of the input
+    const std::vector<std::string> truncated = {"\xC3", "\xE2\x82", "\xF0\x9D\x84"};
+
+    for(const std::size_t position : {0, 1, 13, 14, 15, 16, 17, 29, 30, 31, 32, 33, 47, 48, 62, 63, 64, 100})
+    {
+        const std::string padding(position, 'a');
+
+        for(const Case & test : cases)
+        {
+            for(const std::string & suffix : {std::string(), std::string(40, 'b')})
+            {
+                const std::string text = padding + test.bytes + suffix;
+                XmlStringViewBufferReader buffer(text);
+                assert(buffer.validation() == test.validation);
+                if(test.validation != XmlBufferReader::Valid) assert(buffer.validationOffset() == position);
+            }
+        }
+
+        for(const std::string & bytes : truncated)
+        {
+            XmlStringViewBufferReader buffer(padding + bytes);
+            assert(buffer.validation() == XmlBufferReader::InvalidSequence && buffer.validationOffset() == position);
+            assert(XmlStringViewBufferReader(padding + bytes + "b").validation() == XmlBufferReader::InvalidSequence);
+        }
+    }
+
+    XmlReader reader;
+    XmlNode node;
+    assert(!reader.read("<a>xy\xE0\x80\x80</a>", node) && reader.error() == "Invalid UTF-8 sequence, offset: 5");
+    assert(!reader.read("<a b='\x01'/>", node) && reader.error() == "Control character detection, offset: 6");
+
+    //A sequence split by the end of a file block is carried over to the next one
+    const std::string fileName = (std::filesystem::temp_directory_path() / "XmlTestUtf8.xml").string();
+    const std::size_t block = 64 * 1024;
+
+    for(const std::string & bytes : {std::string("\xE2\x82\xAC"), std::string("\xE2\x82" "A")})
+    {
+        for(std::size_t split = 1; split < 3; split++)
+        {
+            const std::string xml = "<a>" + std::string(block - 3 - split, 'c') + bytes + "</a>";
+            std::ofstream(fileName, std::ios::binary) << xml;
+
+            XmlFileBufferReader file;
+            assert(file.open(fileName));
+            const bool valid = reader.read(file, node);
+            assert(valid == (bytes[2] != 'A'));
+            if(valid) assert(node.value().size() == block - 3 - split + 3);
+            else assert(reader.error() == "Invalid UTF-8 sequence, offset: " + std::to_string(block - split));
+        }
+    }
+
+    std::filesystem::remove(fileName);
+}
+
+//Attributes, comments, instructions, CDATA and blank text are read as documented and written back unchanged
+static void testParsing()
+{
+    const std::string xml = "<?xml version=\"1.0\"?>\n<!-- head -->\n<root a=\"1 &amp; 2\" b='&quot;q&apos;'>\n"
+                            "  <c>&lt;x&gt; &#65;&#x42;&#x20AC;</c>\n  <d><![CDATA[<raw> & ]]>!</d>\n  <?pi data?>\n  <e>  </e>\n"
+                            "  <f>a<!-- skipped -->b</f>\n  <g/>\n</root>";
+
+    XmlReader reader;
+    XmlNode root;
+    assert(reader.read(xml, root));
+    assert(root.attributeValue("a") == "1 & 2" && root.attributeValue("b") == "\"q'");
+    assert(root.child("c")[0].value() == "<x> AB\xE2\x82\xAC" && root.child("d")[0].value() == "<raw> & !");
+    assert(root.child("e")[0].value() == "  " && root.child("f")[0].value() == "ab" && !root.child("g")[0].isChilds());
+    assert(root.childs().size() == 5);
+
+    XmlWriter writer;
+    const std::string written = writer.write(root);
+    assert(written == "<root a=\"1 &amp; 2\" b=\"&quot;q&apos;\"><c>&lt;x&gt; AB\xE2\x82\xAC</c><d>&lt;raw&gt; &amp; !</d><e>  </e><f>ab</f><g/></root>");
+
+    for(const bool beautiful : {false, true})
+    {
+        const XmlNode again = reader.read(writer.write(root, beautiful));
+        assert(again.equals(root) && writer.write(again) == written);
+    }
+
+    //Entity errors are reported at the ampersand of the rejected reference
+    const std::vector<std::pair<std::string, std::size_t>> errors =
+    {
+        {"<a>&#0;</a>", 3}, {"<a>xy&bogus;</a>", 5}, {"<a b='1&#xD800;'/>", 7}, {"<a>x<!-- c -->y&lt;&#1;</a>", 19},
+        {"<a><![CDATA[&]]>&amp</a>", 16}, {"<a>&am<!---->p;</a>", 3}, {"<a><b/>  &#0;<c/></a>", 9}
+    };
+
+    for(const auto & [text, offset] : errors)
+    {
+        assert(!reader.read(text, root) && reader.error() == "Invalid entity, offset: " + std::to_string(offset));
+    }
+}
+
+//Structs are written and read back through their schema, values that don't parse stop the read with the field named
+static void testSchemaBinding()
+{
+    Shape shape;
+    shape.id = "a & b";
+    shape.visible = true;
+    shape.count = 65535;
+    shape.origin = {-3, 0.25, "<o>"};
+    shape.points = {{1, 1.5, "p1"}, {2, -2.5, ""}};
+    shape.tags = {{"k1", "v1"}, {"k2", "v 2"}};
+    shape.sizes = {7, -8, 9};
+
+    std::string xml;
+    XmlBindWriter<Shape> writer;
+    assert(writer.write(xml, "shape", shape));
+    assert(xml == "<shape id=\"a &amp; b\" visible=\"true\"><count>65535</count><origin x=\"-3\" y=\"0.25\"><label>&lt;o&gt;</label></origin>"
+                  "<point x=\"1\" y=\"1.5\"><label>p1</label></point><point x=\"2\" y=\"-2.5\"><label/></point>"
+                  "<tag key=\"k1\">v1</tag><tag key=\"k2\">v 2</tag><size>7</size><size>-8</size><size>9</size></shape>");
+
+    XmlBindReader<Shape> reader("shape");
+
+    for(const bool beautiful : {false, true})
+    {
+        std::string text;
+        assert(writer.write(text, "shape", shape, beautiful));
+
+        Shape read;
+        assert(reader.read(text, read) && reader.error().empty());
+        assert(read.id == shape.id && read.visible && read.count == shape.count && samePoint(read.origin, shape.origin));
+        assert(read.points.size() == 2 && samePoint(read.points[0], shape.points[0]) && samePoint(read.points[1], shape.points[1]));
+        assert(read.tags.size() == 2 && read.tags[1].key == "k2" && read.tags[1].text == "v 2" && read.sizes == shape.sizes);
+
+        std::string again;
+        assert(writer.write(again, "shape", read) && again == xml);
+    }
+
+    //Unknown names are skipped, blanks around numbers are accepted
+    Shape skipped;
+    assert(reader.read("<shape other='1'><unknown><point x='5'/></unknown><size> 4 </size></shape>", skipped));
+    assert(skipped.points.empty() && skipped.sizes == std::vector<int>{4});
+
+    const std::vector<std::pair<std::string, std::string>> errors =
+    {
+        {"<other/>", "Unexpected root node 'other'"},
+        {"<shape visible='yes'/>", "Invalid value of attribute 'visible'"},
+        {"<shape><count>65536</count></shape>", "Invalid value of node 'count'"},
+        {"<shape><count>12a</count></shape>", "Invalid value of node 'count'"},
+        {"<shape><origin x='1.5'/></shape>", "Invalid value of attribute 'x'"},
+        {"<shape><point x='1'/><point x='2' y='z'/></shape>", "Invalid value of attribute 'y'"},
+        {"<shape><size>1</size><size>-</size></shape>", "Invalid value of node 'size'"}
+    };
+
+    for(const auto & [text, error] : errors)
+    {
+        Shape read;
+        assert(!reader.read(text, read) && reader.error() == error);
+    }
+
+    Shape valid;
+    assert(reader.read(xml, valid) && reader.error().empty() && valid.sizes.size() == 3);
+}
+
+//Const accessors of one tree and of its copy are read from several threads at once
+static void testConcurrentReads()
+{
+    const XmlNode root = makeTree();
+    const XmlNode copy = root.copy();
+    const std::size_t hash = root.hash();
+
+    std::vector<std::thread> threads;
+
+    for(int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            for(int i = 0; i < 200; i++)
+            {
+                for(const XmlNode & node : {root, copy})
+                {
+                    assert(node.child("x").size() == 8);
+                    assert(node.child("x")[3].child("y")[0].value() == "3");
+                    assert(node.childs().size() == 8);
+                    assert(node.childs().front().parent().isValid());
+                    assert(node.hash() == hash);
+                }
+            }
+        });
+    }
+
+    for(auto & thread : threads) thread.join();
+}
+
+static void testCopyIsolation()
+{
+    XmlNode original = makeTree();
+    const std::size_t hash = original.hash();
+
+    //Reading a copy does not clone it, its handles change the copy
+    XmlNode copy = original.copy();
+    assert(copy.child("x").size() == 8 && copy.hash() == hash);
+    for(XmlNode child : copy.childs()) child.addAttribute("a", "1");
+    assert(copy.childs().back().containsAttribute("a") && copy.hash() != hash);
+    for(const XmlNode & child : original.childs()) assert(!child.containsAttribute("a"));
+    assert(original.hash() == hash);
+    copy = original.copy();
+
+    //A grandchild changed through the copy
+    copy.child("x")[2].child("y")[0].setValue("changed");
+    assert(copy.child("x")[2].child("y")[0].value() == "changed");
+    assert(original.child("x")[2].child("y")[0].value() == "2");
+    assert(original.hash() == hash && copy.hash() != hash);
+
+    //A grandchild kept after the child it was read through is gone
+    XmlNode grandchild = copy.child("x")[3].child("y")[0];
+    grandchild.setValue("kept");
+    assert(copy.child("x")[3].child("y")[0].value() == "kept");
+    assert(original.child("x")[3].child("y")[0].value() == "3");
+
+    //A grandchild changed through the original
+    XmlNode other = original.copy();
+    original.child("x")[5].addAttribute("k", "v");
+    assert(original.child("x")[5].containsAttribute("k"));
+    assert(!other.child("x")[5].containsAttribute("k"));
+    assert(other.hash() == hash);
+
+    //A handle kept since it was added changes the tree it was added to
+    XmlNode root("root");
+    XmlNode child("child");
+    root.addChild(child);
+    XmlNode snapshot = root.copy();
+    child.setValue("v");
+    assert(root.child("child")[0].value() == "v");
+    assert(snapshot.child("child")[0].value().empty());
+    assert(child.parent().hash() == root.hash());
+
+    //Handles of the same child share their changes
+    XmlNode twice = original.copy();
+    XmlNode first = twice.child("x")[6], second = twice.child("x")[6];
+    first.addAttribute("a", "1");
+    second.addAttribute("b", "2");
+    assert(twice.child("x")[6].containsAttribute("a") && twice.child("x")[6].containsAttribute("b"));
+    assert(!original.child("x")[6].containsAttribute("a") && !original.child("x")[6].containsAttribute("b"));
+
+    //A handle whose child was removed is left a root
+    XmlNode shared = root.copy();
+    XmlNode removed = shared.child("child")[0];
+    shared.removeChild("child");
+    removed.setValue("w");
+    assert(!shared.isChilds() && !removed.parent().isValid());
+    assert(root.child("child")[0].value() == "v");
+}
+
+//A node added to a second parent is stored as a copy, the handle keeps changing the first tree only
+static void testAddedTwice()
+{
+    XmlNode a("a"), b("b"), s("s");
+    s.setValue("1");
+    a.addChild(s);
+    b.addChild(s);
+
+    XmlWriter plain, caching;
+    caching.setCaching(true);
+    const std::size_t hash = a.hash();
+    const XmlNode before = a.copy();
+    assert(caching.write(a) == "<a><s>1</s></a>");
+
+    s.setValue("2");
+    assert(a.hash() != hash && caching.write(a) == plain.write(a) && plain.write(a) == "<a><s>2</s></a>");
+    assert(plain.write(b) == "<b><s>1</s></b>" && b.child("s")[0].parent().nodeName() == "b");
+    assert(!a.equals(before) && a.diff(before).size() == 1);
+}
+
+//Deep documents are read, changed, written and released without recursion
+static void testDeepDocument()
+{
+    const std::size_t depth = 200000;
+    std::string xml;
+    for(std::size_t i = 0; i < depth; i++) xml += "<a>";
+    xml += "v";
+    for(std::size_t i = 0; i < depth; i++) xml += "</a>";
+
+    XmlReader reader;
+    const XmlNode root = reader.read(xml);
+    XmlNode copy = root.copy();
+    XmlNode leaf = copy;
+    while(leaf.isChilds()) leaf = leaf.childs().front();
+    leaf.setValue("w");
+
+    assert(XmlWriter().write(root) == xml && root.hash() != copy.hash());
+    assert(copy.diff(root).size() == 1);
+}
+
+//Indexing and diffing read the trees without cloning them, their handles change the tree they came from
+static void testReadOnlyWalks()
+{
+    const XmlNode original = makeTree();
+    XmlNode copy = original.copy();
+
+    XmlIndex index(copy);
+    assert(copy.hash() == original.hash());
+
+    std::vector<XmlNode> found = XmlQuery("/root/x[@i='4']/y").select(index);
+    assert(found.size() == 1);
+    found[0].setValue("changed");
+    assert(copy.child("x")[4].child("y")[0].value() == "changed");
+    assert(original.child("x")[4].child("y")[0].value() == "4");
+
+    XmlNode other = original.copy();
+    std::vector<XmlDifference> differences = copy.diff(other);
+    assert(differences.size() == 1 && differences[0].kind == XmlDifference::Changed);
+    differences[0].after.setValue("changed");
+    assert(copy.equals(other) && !original.equals(other));
+}
+
+//Caching writes follow every change and the cache can be dropped
+static void testCachingWriter()
+{
+    XmlNode root = makeTree();
+    XmlWriter plain, caching;
+    caching.setCaching(true);
+
+    assert(caching.write(root, true) == plain.write(root, true));
+#ifdef XML_STATISTICS
+    XmlWriter fresh;
+    fresh.setCaching(true);
+    root.child("x")[0].child("y")[0].setValue("<&>");
+    const std::string xml = fresh.write(root);
+    const XmlStatistics & cached = fresh.statistics();
+    plain.write(root);
+    const XmlStatistics & written = plain.statistics();
+    assert(cached.elements == 17 && cached.attributes == 8 && cached.entities == 3 && cached.maxDepth == 3);
+    assert(cached.elements == written.elements && cached.attributes == written.attributes);
+    assert(cached.entities == written.entities && cached.maxDepth == written.maxDepth && cached.bytes == xml.size() && written.bytes == xml.size());
+    assert(fresh.write(root) == xml && fresh.statistics().bytes == xml.size());
+#endif
+    XmlNode x = root.child("x")[1];
+    x.addAttribute("k", "2");
+    assert(caching.write(root, true) == plain.write(root, true));
+
+    XmlWriter::clearCache(root);
+    assert(caching.write(root) == plain.write(root));
+}
+
+//Copies of one template are written by caching writers on several threads, the contents they share are only read
+static void testCachingCopies()
+{
+    const XmlNode tmpl = makeTree();
+    XmlWriter writer;
+    const std::string original = writer.write(tmpl);
+    writer.setCaching(true);
+
+    std::vector<std::thread> threads;
+    std::barrier ready(4);
+
+    for(int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            XmlNode copy = tmpl.copy();
+            copy.child("x")[t].addAttribute("t", "1");
+            ready.arrive_and_wait();
+            XmlWriter plain, caching;
+            caching.setCaching(true);
+            assert(caching.write(copy) == plain.write(copy) && caching.write(copy) == plain.write(copy));
+        });
+    }
+
+    for(auto & thread : threads) thread.join();
+    assert(writer.write(tmpl) == original);
+}
+
+//A missing file reports its own error and exceptions on the workers reach the caller
+static void testBatchErrors()
+{
+    XmlBatchReader batch(2);
+    std::vector<std::string> errors;
+
+    batch.readBuffers({"<a><b></a>"}, [&](XmlBatchReader::Document & document){ errors.push_back(document.error); });
+    batch.readFiles({"/nonexistent/a.xml"}, [&](XmlBatchReader::Document & document){ errors.push_back(document.error); });
+    assert(!errors[0].empty() && errors[1] == "Cannot open file: /nonexistent/a.xml");
+
+    bool caught = false;
+
+    try
+    {
+        batch.parseBuffers({"<a/>", "<b/>"}, []{ return std::make_unique<XmlReader>(); }, [](std::size_t index, XmlSAXReader &, bool)
+        {
+            if(index == 1) throw std::runtime_error("done");
+        });
+    }
+    catch(const std::runtime_error &){ caught = true; }
+
+    assert(caught);
+}
+
+//Nodes read through a snapshot reader stay valid until the reader is refreshed
+static void testSnapshotReader()
+{
+    XmlNode first("first");
+    first.addAttribute("v", "1");
+    XmlSnapshot snapshot(first);
+    XmlSnapshot::Reader reader(snapshot);
+
+    const XmlFrozenNode node = reader.root();
+    snapshot.publish(XmlNode("second"));
+    assert(reader.root().nodeName() == "first" && node.attributeValue("v") == "1");
+
+    assert(reader.refresh() && !reader.refresh());
+    assert(reader.root().nodeName() == "second");
+}
+
+int main()
+{
+    testUtf8Validation();
+    testParsing();
+    testSchemaBinding();
+    testConcurrentReads();
+    testCopyIsolation();
+    testAddedTwice();
+    testDeepDocument();
+    testReadOnlyWalks();
+    testCachingWriter();
+    testCachingCopies();
+    testBatchErrors();
+    testSnapshotReader();
+
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}